@@ -0,0 +1,188 @@
+// Benchmark of the grammar trie against the check of the full vocabulary, on a JSON grammar
+//
+// usage: bench-grammar <model.gguf> [n_iter]
+//
+// Follows the tokens of a JSON document under the JSON grammar of llama.cpp (grammars/json.gbnf).
+// At every token it times llama_sample_grammar over the whole vocabulary, which is what sampling
+// with a grammar does, and llama_grammar_trie::mask, checking that both reject the same tokens.
+// It prints the time per token of both where the mask succeeds, and of the path of grpc-server:
+// the mask, and after a mask that gave up (inside strings most of the vocabulary is acceptable)
+// the full pass for the next 16 tokens.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "llama.h"
+#include "grammar-trie.hpp"
+
+static const char *json_grammar = R"(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\\x7F\x00-\x1F] |
+    "\\" (["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F])
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]*)) ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws
+
+ws ::= ([ \t\n] ws)?
+)";
+
+static const char *json_document =
+    "{\"id\": 4127, \"name\": \"Crème brûlée\", \"tags\": [\"dessert\", \"français\", \"甜点\"],\n"
+    " \"price\": 7.5, \"available\": true, \"ratings\": [4, 5, 3.5, -1e2],\n"
+    " \"supplier\": {\"city\": \"Lyon\", \"zip\": \"69001\", \"contact\": null},\n"
+    " \"notes\": \"baked \\\"slowly\\\" at 150\\u00b0C\"}";
+
+static double micros_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <model.gguf> [n_iter]\n", argv[0]);
+        return 1;
+    }
+    const int n_iter = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    llama_model *model = llama_load_model_from_file(argv[1], mparams);
+    if (model == nullptr)
+    {
+        fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = 512;
+    llama_context *ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == nullptr)
+    {
+        fprintf(stderr, "failed to create a context\n");
+        return 1;
+    }
+
+    const int32_t n_vocab = llama_n_vocab(model);
+    llama_vocab_pieces pieces;
+    pieces.init(ctx);
+    llama_grammar_trie trie;
+    trie.init(pieces, n_vocab);
+
+    llama_grammar_cache cache;
+    const llama_grammar_cache::entry *grammar_entry = cache.get(json_grammar);
+    if (grammar_entry == nullptr)
+    {
+        fprintf(stderr, "failed to parse the JSON grammar\n");
+        return 1;
+    }
+    const std::vector<llama_token> tokens = llama_tokenize(ctx, json_document, false);
+
+    std::vector<llama_token_data> cur;
+    std::vector<float> logits(n_vocab);
+    double t_full = 0.0;        // the full pass at every token
+    double t_server = 0.0;      // the path of grpc-server
+    double t_full_masked = 0.0; // both, at the tokens where the mask succeeded
+    double t_trie_masked = 0.0;
+    size_t n_steps = 0;
+    size_t n_masked = 0;
+    size_t n_checked = 0;
+    size_t n_fallback = 0;
+    size_t n_mismatch = 0;
+
+    for (int iter = 0; iter < n_iter; iter++)
+    {
+        llama_grammar *grammar = llama_grammar_copy(grammar_entry->grammar);
+        int n_skip = 0;
+        for (const llama_token tok : tokens)
+        {
+            cur.clear();
+            for (llama_token t = 0; t < n_vocab; t++)
+            {
+                cur.push_back({ t, 0.0f, 0.0f });
+            }
+            llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+            auto t0 = std::chrono::steady_clock::now();
+            llama_sample_grammar(ctx, &cur_p, grammar);
+            const double t_step_full = micros_since(t0);
+            t_full += t_step_full;
+
+            std::fill(logits.begin(), logits.end(), 0.0f);
+            t0 = std::chrono::steady_clock::now();
+            const bool masked = trie.mask(ctx, grammar, logits.data(), n_vocab / 2);
+            const double t_step_trie = micros_since(t0);
+
+            n_steps++;
+            if (n_skip > 0)
+            {
+                n_skip--;
+                t_server += t_step_full;
+            }
+            else
+            {
+                t_server += masked ? t_step_trie : t_step_trie + t_step_full;
+                n_skip = masked ? 0 : 16;
+            }
+
+            if (!masked)
+            {
+                n_fallback++;
+            }
+            else
+            {
+                n_masked++;
+                n_checked += trie.n_checked;
+                t_full_masked += t_step_full;
+                t_trie_masked += t_step_trie;
+                for (llama_token t = 0; t < n_vocab; t++)
+                {
+                    if (std::isinf(cur[t].logit) != std::isinf(logits[t]))
+                    {
+                        n_mismatch++;
+                    }
+                }
+            }
+
+            llama_grammar_accept_token(ctx, grammar, tok);
+        }
+        llama_grammar_free(grammar);
+    }
+
+    printf("vocabulary %d, %zu tokens of JSON x %d\n", n_vocab, tokens.size(), n_iter);
+    printf("where the mask succeeds (%zu of %zu tokens, %.0f tokens checked per token):\n", n_masked, n_steps,
+           n_masked > 0 ? (double) n_checked / n_masked : 0.0);
+    printf("  full vocabulary: %10.1f us/token\n", n_masked > 0 ? t_full_masked / n_masked : 0.0);
+    printf("  trie mask:       %10.1f us/token, %.1fx\n", n_masked > 0 ? t_trie_masked / n_masked : 0.0,
+           t_trie_masked > 0.0 ? t_full_masked / t_trie_masked : 0.0);
+    printf("whole document:\n");
+    printf("  full vocabulary: %10.1f us/token\n", t_full / n_steps);
+    printf("  grpc-server:     %10.1f us/token, %.1fx\n", t_server / n_steps, t_full / t_server);
+    printf("masks that gave up: %zu of %zu, tokens judged differently: %zu\n", n_fallback, n_steps, n_mismatch);
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+    return n_mismatch == 0 ? 0 : 1;
+}
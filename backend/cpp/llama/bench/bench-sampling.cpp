@@ -0,0 +1,145 @@
+// Micro-benchmark of llama_fused_sampler against the sampling chain over the full vocabulary
+//
+// usage: bench-sampling [n_iter]
+//
+// For vocabularies of 32k, 128k and 256k tokens, samples random logits with top-k 40, tfs, typical,
+// top-p 0.95, min-p 0.05, temperature 0.8 and a repetition penalty over the last 64 tokens, and
+// prints the time per token of both paths and whether they kept the same candidates.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "fused-sampler.hpp"
+
+bool server_verbose = false;
+
+// what llama_sampling_sample does without a grammar, on a context-free copy of the chain
+static llama_token sample_full(const llama_sampling_params &sp, const std::vector<llama_token> &prev,
+                               const float *logits, int32_t n_vocab, std::vector<llama_token_data> &cur, std::mt19937 &rng)
+{
+    cur.clear();
+    for (llama_token tok = 0; tok < n_vocab; tok++)
+    {
+        cur.push_back({ tok, logits[tok], 0.0f });
+    }
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+
+    const size_t n_penalty = std::min(prev.size(), (size_t) sp.penalty_last_n);
+    llama_sample_repetition_penalties(nullptr, &cur_p, prev.data() + prev.size() - n_penalty, n_penalty,
+                                      sp.penalty_repeat, sp.penalty_freq, sp.penalty_present);
+
+    llama_sample_top_k    (nullptr, &cur_p, sp.top_k,     sp.min_keep);
+    llama_sample_tail_free(nullptr, &cur_p, sp.tfs_z,     sp.min_keep);
+    llama_sample_typical  (nullptr, &cur_p, sp.typical_p, sp.min_keep);
+    llama_sample_top_p    (nullptr, &cur_p, sp.top_p,     sp.min_keep);
+    llama_sample_min_p    (nullptr, &cur_p, sp.min_p,     sp.min_keep);
+    llama_sample_temp     (nullptr, &cur_p, sp.temp);
+    llama_sample_softmax  (nullptr, &cur_p);
+    cur.resize(cur_p.size);
+
+    const float u = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+    float cum = 0.0f;
+    for (const llama_token_data &c : cur)
+    {
+        cum += c.p;
+        if (u < cum)
+        {
+            return c.id;
+        }
+    }
+    return cur.back().id;
+}
+
+static std::set<llama_token> ids(const std::vector<llama_token_data> &cur)
+{
+    std::set<llama_token> out;
+    for (const llama_token_data &c : cur)
+    {
+        out.insert(c.id);
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    const int n_iter = argc > 1 ? std::atoi(argv[1]) : 200;
+
+    llama_sampling_params sp;
+    sp.top_k          = 40;
+    sp.top_p          = 0.95f;
+    sp.min_p          = 0.05f;
+    sp.temp           = 0.8f;
+    sp.penalty_last_n = 64;
+    sp.penalty_repeat = 1.1f;
+    sp.penalize_nl    = true; // sample_full penalizes every token of the window
+    sp.samplers_sequence = {
+        llama_sampler_type::TOP_K, llama_sampler_type::TFS_Z, llama_sampler_type::TYPICAL_P,
+        llama_sampler_type::TOP_P, llama_sampler_type::MIN_P, llama_sampler_type::TEMPERATURE,
+    };
+
+    llama_sampling_context *ctx_sampling = llama_sampling_init(sp);
+    if (!llama_fused_sampler::supported(ctx_sampling))
+    {
+        fprintf(stderr, "the parameters are not supported by the fused sampler\n");
+        return 1;
+    }
+
+    printf("%8s %12s %12s %8s %10s\n", "n_vocab", "full (us)", "fused (us)", "speedup", "same top");
+    for (const int32_t n_vocab : { 32000, 128256, 256000 })
+    {
+        std::mt19937 gen(1234);
+        std::normal_distribution<float> dist(0.0f, 2.0f);
+        std::uniform_int_distribution<llama_token> pick(0, n_vocab - 1);
+
+        std::vector<std::vector<float>> logits(16, std::vector<float>(n_vocab));
+        for (std::vector<float> &l : logits)
+        {
+            for (float &x : l)
+            {
+                x = dist(gen);
+            }
+        }
+        ctx_sampling->prev.clear();
+        for (int32_t i = 0; i < sp.penalty_last_n; i++)
+        {
+            ctx_sampling->prev.push_back(pick(gen));
+        }
+
+        llama_fused_sampler fused;
+        fused.seed(42);
+        std::mt19937 rng(42);
+        std::vector<llama_token_data> cur;
+
+        // the penalized tokens are the same for both paths, so they must keep the same candidates
+        bool same = true;
+        for (const std::vector<float> &l : logits)
+        {
+            sample_full(sp, ctx_sampling->prev, l.data(), n_vocab, cur, rng);
+            fused.sample(ctx_sampling, n_vocab, 13, l.data());
+            same = same && ids(cur) == ids(ctx_sampling->cur);
+        }
+
+        const auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < n_iter; i++)
+        {
+            sample_full(sp, ctx_sampling->prev, logits[i % logits.size()].data(), n_vocab, cur, rng);
+        }
+        const auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < n_iter; i++)
+        {
+            fused.sample(ctx_sampling, n_vocab, 13, logits[i % logits.size()].data());
+        }
+        const auto t2 = std::chrono::steady_clock::now();
+
+        const double t_full  = std::chrono::duration<double, std::micro>(t1 - t0).count() / n_iter;
+        const double t_fused = std::chrono::duration<double, std::micro>(t2 - t1).count() / n_iter;
+        printf("%8d %12.1f %12.1f %7.1fx %10s\n", n_vocab, t_full, t_fused, t_full / t_fused, same ? "yes" : "no");
+    }
+
+    llama_sampling_free(ctx_sampling);
+    return 0;
+}
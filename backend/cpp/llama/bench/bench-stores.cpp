@@ -0,0 +1,55 @@
+// Benchmark of the in-process vector store behind the Stores* RPCs
+//
+// usage: bench-stores [n_keys] [dim] [n_queries] [top_k]
+//
+// Stores n_keys random unit keys of dim floats (1M x 1024 by default) and prints the time to set
+// them and the time per exact StoresFind. The Go local-store runs the same measurement with
+//     go test -run '^$' -bench StoresFind ./backend/go/stores/
+// and STORES_BENCH_KEYS / STORES_BENCH_DIM for other sizes.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "stores.hpp"
+#include "bench/bench-stores.hpp"
+
+int main(int argc, char **argv)
+{
+    const size_t n_keys    = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    const size_t dim       = argc > 2 ? std::stoul(argv[2]) : 1024;
+    const size_t n_queries = argc > 3 ? std::stoul(argv[3]) : 100;
+    const size_t top_k     = argc > 4 ? std::stoul(argv[4]) : 10;
+
+    const std::vector<float> keys    = random_keys(n_keys, dim, 1);
+    const std::vector<float> queries = random_keys(n_queries, dim, 2);
+
+    vector_store store;
+    std::string error;
+    store.init_dim(dim);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_keys; i++)
+    {
+        if (!store.set(keys.data() + i * dim, std::to_string(i), error))
+        {
+            fprintf(stderr, "set: %s\n", error.c_str());
+            return 1;
+        }
+    }
+    const double t_set = seconds_since(t0);
+
+    std::vector<vector_store::match> matches;
+    t0 = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < n_queries; q++)
+    {
+        store.find(queries.data() + q * dim, top_k, matches);
+    }
+    const double t_find = seconds_since(t0);
+
+    printf("keys %zu x %zu, top_k %zu\n", n_keys, dim, top_k);
+    printf("set:  %8.2f s, %10.0f keys/s\n", t_set, n_keys / t_set);
+    printf("find: %8.3f ms/query\n", 1e3 * t_find / n_queries);
+    return 0;
+}
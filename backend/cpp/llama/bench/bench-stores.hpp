@@ -0,0 +1,37 @@
+#pragma once
+
+// Helpers of the store benchmarks
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+inline std::vector<float> random_keys(size_t n, size_t dim, uint32_t seed)
+{
+    std::mt19937 gen(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<float> keys(n * dim);
+    for (size_t i = 0; i < n; i++)
+    {
+        float *k = keys.data() + i * dim;
+        float norm = 0.0f;
+        for (size_t j = 0; j < dim; j++)
+        {
+            k[j] = dist(gen);
+            norm += k[j] * k[j];
+        }
+        norm = 1.0f / std::sqrt(norm);
+        for (size_t j = 0; j < dim; j++)
+        {
+            k[j] *= norm;
+        }
+    }
+    return keys;
+}
+
+inline double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
@@ -0,0 +1,104 @@
+// Recall of the HNSW index of the vector store, to tune LLAMACPP_STORES_HNSW_EF_SEARCH
+//
+// usage: recall-stores [n_keys] [dim] [n_queries] [top_k] [M] [ef_construction]
+//
+// Stores the same n_keys random unit keys in an exact store and an indexed one, then for each
+// ef_search prints recall@top_k of the indexed find against the exact one and the time per query.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "stores.hpp"
+#include "bench/bench-stores.hpp"
+
+static bool fill(vector_store &store, const std::vector<float> &keys, size_t n_keys, size_t dim)
+{
+    std::string error;
+    store.init_dim(dim);
+    for (size_t i = 0; i < n_keys; i++)
+    {
+        if (!store.set(keys.data() + i * dim, std::to_string(i), error))
+        {
+            fprintf(stderr, "set: %s\n", error.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const size_t n_keys    = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const size_t dim       = argc > 2 ? std::stoul(argv[2]) : 256;
+    const size_t n_queries = argc > 3 ? std::stoul(argv[3]) : 200;
+    const size_t top_k     = argc > 4 ? std::stoul(argv[4]) : 10;
+
+    const std::vector<float> keys    = random_keys(n_keys, dim, 1);
+    const std::vector<float> queries = random_keys(n_queries, dim, 2);
+
+    vector_store exact;
+    vector_store indexed;
+    indexed.use_index = true;
+    if (argc > 5)
+    {
+        indexed.index.M = std::stoi(argv[5]);
+    }
+    if (argc > 6)
+    {
+        indexed.index.ef_construction = std::stoi(argv[6]);
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    if (!fill(exact, keys, n_keys, dim))
+    {
+        return 1;
+    }
+    const double t_exact = seconds_since(t0);
+    t0 = std::chrono::steady_clock::now();
+    if (!fill(indexed, keys, n_keys, dim))
+    {
+        return 1;
+    }
+    const double t_indexed = seconds_since(t0);
+
+    printf("keys %zu x %zu, top_k %zu, M %d, ef_construction %d\n", n_keys, dim, top_k, indexed.index.M, indexed.index.ef_construction);
+    printf("set: exact %.2f s, indexed %.2f s\n", t_exact, t_indexed);
+
+    // the rows of the exact answers
+    std::vector<std::unordered_set<size_t>> truth(n_queries);
+    std::vector<vector_store::match> matches;
+    t0 = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < n_queries; q++)
+    {
+        exact.find(queries.data() + q * dim, top_k, matches);
+        for (const vector_store::match &m : matches)
+        {
+            truth[q].insert(m.row);
+        }
+    }
+    printf("exact:          %8.3f ms/query\n", 1e3 * seconds_since(t0) / n_queries);
+
+    // both stores hold the same rows in the same order, so rows compare directly
+    for (int32_t ef_search : { 16, 32, 64, 128, 256, 512 })
+    {
+        indexed.index.ef_search = ef_search;
+        size_t n_found = 0;
+        size_t n_total = 0;
+        t0 = std::chrono::steady_clock::now();
+        for (size_t q = 0; q < n_queries; q++)
+        {
+            indexed.find(queries.data() + q * dim, top_k, matches);
+            for (const vector_store::match &m : matches)
+            {
+                n_found += truth[q].count(m.row);
+            }
+            n_total += truth[q].size();
+        }
+        const double t_find = seconds_since(t0);
+        printf("ef_search %4d: %8.3f ms/query, recall@%zu %.4f\n", ef_search, 1e3 * t_find / n_queries, top_k, (double) n_found / n_total);
+    }
+    return 0;
+}
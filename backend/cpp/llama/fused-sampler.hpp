@@ -0,0 +1,180 @@
+// Fused top-k sampling for the llama.cpp gRPC backend, shared with bench/bench-sampling.cpp
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+#include "sampling.h"
+#include "utils.hpp"
+
+// sampling for the chains that start with a small top-k, without building the full candidate array:
+// only the top-(k + biased and penalized tokens) raw logits are gathered, blocks whose max cannot enter
+// the selection are skipped, and the rest of the chain runs on the short array left in ctx_sampling->cur
+struct llama_fused_sampler
+{
+    static constexpr int32_t n_top_k_max = 256;
+    static constexpr int32_t n_block     = 64;
+
+    std::mt19937 rng;
+
+    std::vector<std::pair<float, llama_token>> heap; // min-heap of the largest raw logits
+    std::vector<llama_token> modified;               // tokens whose logit is changed by the bias or the penalties
+    std::vector<llama_token> penalty_window;         // sorted, to count the occurrences
+
+    // without a seed each slot draws its own: seeding from the time gave concurrent requests
+    // started in the same second the same stream
+    void seed(uint32_t seed)
+    {
+        static std::random_device rd;
+        rng.seed(seed == LLAMA_DEFAULT_SEED ? rd() : seed);
+    }
+
+    static bool supported(const llama_sampling_context *ctx_sampling)
+    {
+        const llama_sampling_params &sp = ctx_sampling->params;
+        return sp.temp > 0 && sp.mirostat == 0 && ctx_sampling->grammar == nullptr &&
+               sp.top_k > 0 && std::max(sp.top_k, sp.min_keep) <= n_top_k_max &&
+               !sp.samplers_sequence.empty() && sp.samplers_sequence.front() == llama_sampler_type::TOP_K;
+    }
+
+    llama_token sample(llama_sampling_context *ctx_sampling, const llama_model *model, const float *logits)
+    {
+        return sample(ctx_sampling, llama_n_vocab(model), llama_token_nl(model), logits);
+    }
+
+    llama_token sample(llama_sampling_context *ctx_sampling, int32_t n_vocab, llama_token nl, const float *logits)
+    {
+        const llama_sampling_params &sp = ctx_sampling->params;
+
+        const std::vector<llama_token> &penalty_tokens = sp.use_penalty_prompt_tokens ? sp.penalty_prompt_tokens : ctx_sampling->prev;
+        const size_t n_penalty = std::min(penalty_tokens.size(), (size_t) std::max(sp.penalty_last_n, 0));
+        const bool has_penalty = n_penalty > 0 && (sp.penalty_repeat != 1.0f || sp.penalty_freq != 0.0f || sp.penalty_present != 0.0f);
+
+        penalty_window.clear();
+        modified.clear();
+        if (has_penalty)
+        {
+            penalty_window.assign(penalty_tokens.end() - n_penalty, penalty_tokens.end());
+            std::sort(penalty_window.begin(), penalty_window.end());
+            modified = penalty_window;
+        }
+        for (const auto &bias : sp.logit_bias)
+        {
+            modified.push_back(bias.first);
+        }
+        std::sort(modified.begin(), modified.end());
+        modified.erase(std::unique(modified.begin(), modified.end()), modified.end());
+
+        // the k best after the bias and the penalties are among the k + |modified| best raw logits and the modified ones
+        const int32_t n_keep = std::max(sp.top_k, sp.min_keep);
+        const size_t  n_top  = std::min((size_t) n_vocab, n_keep + modified.size());
+        const auto cmp = std::greater<std::pair<float, llama_token>>();
+
+        heap.clear();
+        int32_t i = 0;
+        for (; i < n_vocab && heap.size() < n_top; i++)
+        {
+            heap.push_back({ logits[i], i });
+        }
+        std::make_heap(heap.begin(), heap.end(), cmp);
+        for (; i < n_vocab; i += n_block)
+        {
+            const int32_t n = std::min(n_block, n_vocab - i);
+            if (simd_max(logits + i, n) <= heap.front().first)
+            {
+                continue;
+            }
+            for (int32_t j = i; j < i + n; j++)
+            {
+                if (logits[j] > heap.front().first)
+                {
+                    std::pop_heap(heap.begin(), heap.end(), cmp);
+                    heap.back() = { logits[j], j };
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+            }
+        }
+
+        std::vector<llama_token_data> &cur = ctx_sampling->cur;
+        cur.clear();
+        for (const auto &top : heap)
+        {
+            cur.push_back({ top.second, top.first, 0.0f });
+        }
+        for (const llama_token tok : modified)
+        {
+            const bool in_top = std::any_of(heap.begin(), heap.end(), [tok](const std::pair<float, llama_token> &top) { return top.second == tok; });
+            if (tok >= 0 && tok < n_vocab && !in_top)
+            {
+                cur.push_back({ tok, logits[tok], 0.0f });
+            }
+        }
+
+        // same order as llama_sampling_sample: logit bias, then the repetition penalties
+        for (llama_token_data &c : cur)
+        {
+            const auto bias = sp.logit_bias.find(c.id);
+            if (bias != sp.logit_bias.end())
+            {
+                c.logit += bias->second;
+            }
+            if (!has_penalty || (c.id == nl && !sp.penalize_nl))
+            {
+                continue;
+            }
+            const auto range = std::equal_range(penalty_window.begin(), penalty_window.end(), c.id);
+            const int32_t count = range.second - range.first;
+            if (count > 0)
+            {
+                c.logit = c.logit <= 0 ? c.logit * sp.penalty_repeat : c.logit / sp.penalty_repeat;
+                c.logit -= float(count) * sp.penalty_freq + sp.penalty_present;
+            }
+        }
+
+        // the rest of the chain on the short array, without a context so that slots can sample concurrently
+        llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+        for (const llama_sampler_type sampler : sp.samplers_sequence)
+        {
+            switch (sampler)
+            {
+                case llama_sampler_type::TOP_K    : llama_sample_top_k    (nullptr, &cur_p, sp.top_k,     sp.min_keep); break;
+                case llama_sampler_type::TFS_Z    : llama_sample_tail_free(nullptr, &cur_p, sp.tfs_z,     sp.min_keep); break;
+                case llama_sampler_type::TYPICAL_P: llama_sample_typical  (nullptr, &cur_p, sp.typical_p, sp.min_keep); break;
+                case llama_sampler_type::TOP_P    : llama_sample_top_p    (nullptr, &cur_p, sp.top_p,     sp.min_keep); break;
+                case llama_sampler_type::MIN_P    : llama_sample_min_p    (nullptr, &cur_p, sp.min_p,     sp.min_keep); break;
+                case llama_sampler_type::TEMPERATURE:
+                    if (sp.dynatemp_range > 0)
+                    {
+                        const float dynatemp_min = std::max(0.0f, sp.temp - sp.dynatemp_range);
+                        const float dynatemp_max = std::max(0.0f, sp.temp + sp.dynatemp_range);
+                        llama_sample_entropy(nullptr, &cur_p, dynatemp_min, dynatemp_max, sp.dynatemp_exponent);
+                    }
+                    else
+                    {
+                        llama_sample_temp(nullptr, &cur_p, sp.temp);
+                    }
+                    break;
+                default : break;
+            }
+        }
+        llama_sample_softmax(nullptr, &cur_p);
+        cur.resize(cur_p.size);
+
+        const float u = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+        float cum = 0.0f;
+        for (size_t j = 0; j < cur_p.size; j++)
+        {
+            cum += cur_p.data[j].p;
+            if (u < cum)
+            {
+                return cur_p.data[j].id;
+            }
+        }
+        return cur_p.data[cur_p.size - 1].id;
+    }
+};
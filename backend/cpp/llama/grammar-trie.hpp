@@ -0,0 +1,250 @@
+// Vocabulary pieces, grammar cache and grammar trie of the llama.cpp gRPC backend, shared with
+// bench/bench-grammar.cpp and test/test-grammar-trie.cpp
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+#include "grammar-parser.h"
+#include "llama.h"
+
+// the piece of every token of the vocabulary, detokenized once at load into a single byte arena
+struct llama_vocab_pieces
+{
+    std::string           arena;
+    std::vector<uint32_t> offsets; // n_vocab + 1
+
+    void init(llama_context *ctx)
+    {
+        const int32_t n_vocab = llama_n_vocab(llama_get_model(ctx));
+        arena.clear();
+        offsets.resize(n_vocab + 1);
+        for (llama_token tok = 0; tok < n_vocab; tok++)
+        {
+            offsets[tok] = arena.size();
+            arena += llama_token_to_piece(ctx, tok);
+        }
+        offsets[n_vocab] = arena.size();
+    }
+
+    std::string_view get(llama_token tok) const
+    {
+        if (tok < 0 || tok + 1 >= (llama_token) offsets.size())
+        {
+            return {};
+        }
+        return std::string_view(arena.data() + offsets[tok], offsets[tok + 1] - offsets[tok]);
+    }
+
+    void append(std::string &out, llama_token tok) const
+    {
+        const std::string_view piece = get(tok);
+        out.append(piece.data(), piece.size());
+    }
+};
+
+// grammars parsed and compiled once, slots start from a llama_grammar_copy of the cached state
+struct llama_grammar_cache
+{
+    struct entry
+    {
+        size_t hash;
+        std::string text;
+        grammar_parser::parse_state parsed;
+        llama_grammar *grammar = nullptr;
+    };
+
+    size_t n_max = 32;
+    std::list<entry> entries; // most recently used first
+
+    ~llama_grammar_cache()
+    {
+        for (entry &e : entries)
+        {
+            llama_grammar_free(e.grammar);
+        }
+    }
+
+    // nullptr if the grammar does not parse or has no root rule
+    const entry * get(const std::string &text)
+    {
+        const size_t hash = std::hash<std::string>{}(text);
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->hash == hash && it->text == text)
+            {
+                entries.splice(entries.begin(), entries, it);
+                return &entries.front();
+            }
+        }
+
+        entry e;
+        e.hash   = hash;
+        e.text   = text;
+        e.parsed = grammar_parser::parse(text.c_str());
+
+        const auto root = e.parsed.symbol_ids.find("root");
+        if (e.parsed.rules.empty() || root == e.parsed.symbol_ids.end())
+        {
+            return nullptr;
+        }
+
+        std::vector<const llama_grammar_element *> rules(e.parsed.c_rules());
+        e.grammar = llama_grammar_init(rules.data(), rules.size(), root->second);
+        if (e.grammar == nullptr)
+        {
+            return nullptr;
+        }
+
+        entries.push_front(std::move(e));
+        while (entries.size() > n_max)
+        {
+            llama_grammar_free(entries.back().grammar);
+            entries.pop_back();
+        }
+        return &entries.front();
+    }
+};
+
+// the tokens sorted by piece, so that the tokens sharing a prefix form a contiguous range: a prefix trie
+// without nodes. A grammar accepts the prefixes of what it accepts, so rejecting the token of a node
+// rejects its whole range, and the grammar only has to check one token per surviving node.
+struct llama_grammar_trie
+{
+    struct node
+    {
+        int32_t begin;
+        int32_t end;
+        int32_t depth;
+    };
+
+    const llama_vocab_pieces *pieces = nullptr;
+
+    std::vector<llama_token> sorted;       // tokens with a non-empty piece, by piece
+    std::vector<llama_token> empty_pieces; // checked individually, the grammar decides on eos
+
+    // tokens with a non-empty piece the grammar checked in the last mask()
+    size_t n_checked = 0;
+
+    // scratch of mask()
+    std::vector<node> frontier;
+    std::vector<node> next;
+    std::vector<node> checked;
+    std::vector<llama_token_data> candidates;
+
+    void init(const llama_vocab_pieces &pieces_, int32_t n_vocab)
+    {
+        pieces = &pieces_;
+        sorted.clear();
+        empty_pieces.clear();
+        for (llama_token tok = 0; tok < n_vocab; tok++)
+        {
+            (pieces->get(tok).empty() ? empty_pieces : sorted).push_back(tok);
+        }
+        std::sort(sorted.begin(), sorted.end(), [this](llama_token a, llama_token b) {
+            return pieces->get(a) < pieces->get(b);
+        });
+    }
+
+    // split the tokens of a node whose pieces are all longer than depth by their next byte
+    void push_children(int32_t begin, int32_t end, int32_t depth)
+    {
+        while (begin < end)
+        {
+            // bytes compare unsigned, as std::string_view orders the pieces in init()
+            const unsigned char c = pieces->get(sorted[begin])[depth];
+            const int32_t group_end = std::upper_bound(sorted.begin() + begin, sorted.begin() + end, c,
+                [this, depth](unsigned char value, llama_token tok) { return value < (unsigned char) pieces->get(tok)[depth]; }) - sorted.begin();
+            next.push_back({ begin, group_end, depth + 1 });
+            begin = group_end;
+        }
+    }
+
+    // set the logits of the tokens the grammar rejects to -INFINITY; returns false, leaving the check
+    // to the full vocabulary pass, when more than max_checked tokens had to be checked one by one
+    bool mask(llama_context *ctx, const llama_grammar *grammar, float *logits, size_t max_checked)
+    {
+        n_checked = 0;
+
+        candidates.clear();
+        for (const llama_token tok : empty_pieces)
+        {
+            candidates.push_back({ tok, 0.0f, 0.0f });
+        }
+        if (!candidates.empty())
+        {
+            llama_token_data_array cur_p = { candidates.data(), candidates.size(), false };
+            llama_sample_grammar(ctx, &cur_p, grammar);
+            for (const llama_token_data &c : candidates)
+            {
+                if (std::isinf(c.logit))
+                {
+                    logits[c.id] = -INFINITY;
+                }
+            }
+        }
+
+        next.clear();
+        push_children(0, sorted.size(), 0);
+
+        while (!next.empty())
+        {
+            frontier.swap(next);
+            next.clear();
+
+            // the first token of a node is the one whose piece is the prefix itself, if there is one
+            checked.clear();
+            candidates.clear();
+            for (const node &n : frontier)
+            {
+                if ((int32_t) pieces->get(sorted[n.begin]).size() == n.depth)
+                {
+                    checked.push_back(n);
+                    candidates.push_back({ sorted[n.begin], 0.0f, 0.0f });
+                }
+                else
+                {
+                    push_children(n.begin, n.end, n.depth);
+                }
+            }
+
+            n_checked += candidates.size();
+            if (n_checked > max_checked)
+            {
+                return false;
+            }
+            if (candidates.empty())
+            {
+                continue;
+            }
+
+            llama_token_data_array cur_p = { candidates.data(), candidates.size(), false };
+            llama_sample_grammar(ctx, &cur_p, grammar);
+
+            for (size_t i = 0; i < checked.size(); i++)
+            {
+                const node &n = checked[i];
+                if (std::isinf(candidates[i].logit))
+                {
+                    for (int32_t j = n.begin; j < n.end; j++)
+                    {
+                        logits[sorted[j]] = -INFINITY;
+                    }
+                }
+                else
+                {
+                    push_children(n.begin + 1, n.end, n.depth);
+                }
+            }
+        }
+
+        return true;
+    }
+};
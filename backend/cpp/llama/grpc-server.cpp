@@ -10,6 +10,7 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <getopt.h>
 #include "clip.h"
 #include "llava.h"
@@ -21,6 +22,9 @@
 #include "backend.pb.h"
 #include "backend.grpc.pb.h"
 #include "utils.hpp"
+#include "stores.hpp"
+#include "fused-sampler.hpp"
+#include "grammar-trie.hpp"
 
 // include std::regex
 #include <cstddef>
@@ -28,12 +32,16 @@
 #include <mutex>
 #include <chrono>
 #include <regex>
+#include <sstream>
+#include <random>
+#include <list>
 #include <condition_variable>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
 #include <atomic>
 #include <signal.h>
+#include <unistd.h>
 
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -59,6 +67,34 @@ struct server_params
     int32_t write_timeout = 600;
     bool slots_endpoint = true;
     bool metrics_endpoint = false;
+
+    // all slots share the whole context instead of n_ctx / n_parallel each
+    bool elastic_ctx = false;
+
+    // directory for the KV state of preempted slots, kept in host memory when empty
+    std::string swap_path;
+
+    // system prompts kept in the KV cache, each in its own sequence after the slots
+    int32_t n_system_prompts = 4;
+
+    // texts of additional end-of-generation tokens
+    std::vector<std::string> eog_tokens;
+
+    // threads besides the main one that sample the slots on the fused path
+    int32_t n_sampling_threads = 0;
+
+    // reranking with a causal model: the prompt of a (query, document) pair and the tokens
+    // whose logits give the relevance, as sigmoid(logit(yes) - logit(no))
+    std::string rerank_template = "Query: {query}\nDocument: {document}\nIs the document relevant to the query? Answer yes or no.\nAnswer:";
+    std::string rerank_yes = " yes";
+    std::string rerank_no  = " no";
+
+    // scale the embeddings to a unit L2 norm
+    bool normalize_embeddings = false;
+
+    // serve embeddings only, packing up to n_embedding_seqs inputs per batch without slots
+    bool embedding_only = false;
+    int32_t n_embedding_seqs = 64;
 };
 
 bool server_verbose = false;
@@ -73,55 +109,21 @@ static size_t common_part(const std::vector<llama_token> &a, const std::vector<l
     return i;
 }
 
-enum stop_type
-{
-    STOP_FULL,
-    STOP_PARTIAL,
-};
-
-static bool ends_with(const std::string &str, const std::string &suffix)
-{
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
-
-static size_t find_partial_stop_string(const std::string &stop,
-                                       const std::string &text)
-{
-    if (!text.empty() && !stop.empty())
-    {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
-        {
-            if (stop[char_index] == text_last_char)
-            {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial))
-                {
-                    return text.size() - char_index - 1;
-                }
-            }
-        }
-    }
-    return std::string::npos;
-}
-
-// TODO: reuse llama_detokenize
 template <class Iter>
-static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
+static std::string tokens_to_str(const llama_vocab_pieces &pieces, Iter begin, Iter end)
 {
     std::string ret;
     for (; begin != end; ++begin)
     {
-        ret += llama_token_to_piece(ctx, *begin);
+        pieces.append(ret, *begin);
     }
     return ret;
 }
 
 // format incomplete utf-8 multibyte character for output
-static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
+static std::string tokens_to_output_formatted_string(const llama_vocab_pieces &pieces, const llama_token token)
 {
-    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token);
+    std::string out(pieces.get(token));
     // if the size is 1 and first bit is 1, meaning it's a partial character
     //   (size > 1 meaning it's already a known token)
     if (out.size() == 1 && (out[0] & 0x80) == 0x80)
@@ -135,7 +137,7 @@ static std::string tokens_to_output_formatted_string(const llama_context *ctx, c
 }
 
 // convert a vector of completion_token_output to json
-static json probs_vector_to_json(const llama_context *ctx, const std::vector<completion_token_output> &probs)
+static json probs_vector_to_json(const llama_vocab_pieces &pieces, const std::vector<completion_token_output> &probs)
 {
     json out = json::array();
     for (const auto &prob : probs)
@@ -143,22 +145,31 @@ static json probs_vector_to_json(const llama_context *ctx, const std::vector<com
         json probs_for_token = json::array();
         for (const auto &p : prob.probs)
         {
-            std::string tok_str = tokens_to_output_formatted_string(ctx, p.tok);
+            std::string tok_str = tokens_to_output_formatted_string(pieces, p.tok);
             probs_for_token.push_back(json
             {
                 {"tok_str", tok_str},
                 {"prob",    p.prob},
             });
         }
-        std::string tok_str = tokens_to_output_formatted_string(ctx, prob.tok);
+        std::string tok_str = tokens_to_output_formatted_string(pieces, prob.tok);
         out.push_back(json{
             {"content", tok_str},
+            {"prob",    prob.prob},
             {"probs",   probs_for_token},
         });
     }
     return out;
 }
 
+// a completed beam: its generated tokens and its score, the sum of their log-probabilities over their count
+struct beam_hypothesis
+{
+    std::vector<llama_token> tokens;
+    float score;
+    bool eog;
+};
+
 struct llama_client_slot
 {
     int id;
@@ -187,11 +198,25 @@ struct llama_client_slot
     std::string generated_text;
     llama_token sampled;
     std::vector<llama_token> cache_tokens;
-    std::vector<completion_token_output> generated_token_probs;
+    completion_token_probs generated_token_probs;
+
+    // reused for every sampled token
+    completion_token_output token_output;
+    logprobs_engine logprobs;
+    llama_fused_sampler fused_sampler;
+
+    int32_t n_grammar_full = 0; // steps left checking the grammar over the whole vocabulary
+
+    bool send_pending = false; // token_output is to be streamed by the main thread
+    bool sampled_async = false;
+    bool has_next_async = false;
 
     bool infill = false;
     bool embedding = false;
+    bool rerank = false;
     bool has_next_token = true;
+    bool preempted = false;         // KV cells freed, waiting to be recomputed from cache_tokens
+    bool preempt_requested = false; // yield the KV cells at the next update
     bool truncated = false;
     bool stopped_eos = false;
     bool stopped_word = false;
@@ -201,6 +226,8 @@ struct llama_client_slot
     std::string oaicompat_model;
 
     std::string stopping_word;
+    stop_string_matcher stop_matcher;
+    utf8_decoder utf8;
 
     // sampling
     struct llama_sampling_params sparams;
@@ -215,6 +242,10 @@ struct llama_client_slot
     // multimodal
     std::vector<slot_image> images;
 
+    // system prompt requested by the task, and the one whose cells start the sequence
+    std::string system_key;
+    std::vector<llama_token> system_tokens;
+
     // stats
     size_t sent_count = 0;
     size_t sent_token_probs_index = 0;
@@ -228,18 +259,41 @@ struct llama_client_slot
     // multitasks
     int multitask_id = -1;
 
+    // slots (id, task id) of the other completions of the request, forked from this slot once the prompt is evaluated
+    std::vector<std::pair<int, int>> fork_slots;
+
+    // beam search: the slot holding the state of the search, the sum of the log-probabilities of
+    // the tokens of this beam and the best candidates for its next token
+    int beam_leader = -1;
+    float beam_score = 0.0f;
+    bool beam_ready = false;
+    std::vector<completion_token_output::token_prob> beam_candidates;
+    std::vector<llama_token> beam_penalty_window; // sorted, to count the occurrences
+
+    // on the slot holding the search: its width and the beams that have ended
+    int32_t n_beams = 0;
+    std::vector<beam_hypothesis> beam_finished;
+
+    // KV cells of a preempted slot (llama_state_seq data), in host memory or in a file
+    std::vector<uint8_t> swap_state;
+    std::string swap_file;
+
     void reset() {
         num_prompt_tokens      = 0;
-        generated_text         = "";
+        generated_text.clear();
         truncated              = false;
         stopped_eos            = false;
         stopped_word           = false;
         stopped_limit          = false;
         stopping_word          = "";
+        utf8.reset();
         n_past                 = 0;
         sent_count             = 0;
         sent_token_probs_index = 0;
         infill                 = false;
+        rerank                 = false;
+        preempted              = false;
+        preempt_requested      = false;
         ga_i                   = 0;
         n_past_se              = 0;
 
@@ -255,6 +309,20 @@ struct llama_client_slot
         }
 
         images.clear();
+        fork_slots.clear();
+
+        beam_leader = -1;
+        beam_score  = 0.0f;
+        beam_ready  = false;
+        n_beams     = 0;
+        beam_finished.clear();
+
+        swap_state.clear();
+        if (!swap_file.empty())
+        {
+            std::remove(swap_file.c_str());
+            swap_file.clear();
+        }
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -294,6 +362,15 @@ struct llama_client_slot
         generated_token_probs.push_back(token);
     }
 
+    // size the generation buffers for a request, a no-op once a previous request grew them enough
+    void reserve_buffers(int32_t n_predict, int32_t n_probs) {
+        const size_t n_tokens = n_predict > 0 ? std::min(n_predict, n_ctx) : n_ctx;
+
+        generated_text.reserve(n_tokens * 4);
+        generated_token_probs.reserve(n_tokens, std::max(n_probs, 0));
+        token_output.probs.reserve(std::max(n_probs, 0));
+    }
+
     void release() {
         if (state == PROCESSING)
         {
@@ -368,6 +445,10 @@ struct llama_metrics {
     uint64_t n_tokens_predicted       = 0;
     uint64_t t_tokens_generation      = 0;
 
+    uint64_t n_embeddings_total       = 0;
+    uint64_t n_embeddings             = 0;
+    uint64_t t_embedding              = 0; // us
+
 
     void on_prompt_eval(const llama_client_slot &slot) {
         n_prompt_tokens_processed_total += slot.num_prompt_tokens_processed;
@@ -376,6 +457,18 @@ struct llama_metrics {
         t_prompt_processing       += slot.t_prompt_processing;
     }
 
+    void on_embedding_batch(uint64_t n_seqs, uint64_t n_tokens, uint64_t t_us) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_embeddings_total              += n_seqs;
+
+        n_embeddings        += n_seqs;
+        t_embedding         += t_us;
+    }
+
+    double embeddings_per_second() const {
+        return t_embedding > 0 ? 1e6 * n_embeddings / t_embedding : 0.0;
+    }
+
     void on_prediction(const llama_client_slot &slot) {
         n_tokens_predicted_total += slot.n_decoded;
 
@@ -388,7 +481,218 @@ struct llama_metrics {
         t_prompt_processing       = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+        n_embeddings              = 0;
+        t_embedding               = 0;
+    }
+};
+
+// adaptive n_batch for update_slots
+//
+// remembers the largest chunk that fitted in the KV cache instead of halving from params.n_batch on every call,
+// probes larger chunks again after a run of successful decodes and, among the sizes that fit,
+// prefers the one with the lowest measured time per token
+struct llama_batch_controller {
+    int32_t n_batch_max = 0; // configured n_batch
+    int32_t n_batch_fit = 0; // largest n_batch known to fit in the KV cache
+    int32_t n_batch_cur = 0; // last n_batch handed out
+
+    int32_t n_success   = 0; // successful full-chunk decodes since the last failure or probe
+    int32_t n_probe     = 64;
+
+    // timing a decode waits for the backend and stalls the pipeline, so only one full chunk
+    // of the proposed n_batch in n_time_every is timed
+    int32_t n_timed      = 0;
+    int32_t n_time_every = 16;
+
+    // EMA of the decode time per token (us), only measured on full chunks of the proposed n_batch
+    std::map<int32_t, double> t_per_token;
+
+    void init(int32_t n_batch) {
+        n_batch_max = n_batch;
+        n_batch_fit = n_batch;
+        n_batch_cur = n_batch;
+        n_success   = 0;
+        n_timed     = 0;
+        t_per_token.clear();
+    }
+
+    int32_t get_n_batch(int32_t n_kv_free) {
+        int32_t n_batch = n_batch_fit;
+
+        // try the learned limit at least once before trusting the measurements of smaller chunks
+        if (t_per_token.count(n_batch_fit) != 0)
+        {
+            double t_best = t_per_token[n_batch_fit];
+            for (const auto & it : t_per_token)
+            {
+                if (it.first < n_batch_fit && it.second < t_best * 0.9)
+                {
+                    n_batch = it.first;
+                    t_best  = it.second;
+                }
+            }
+        }
+
+        if (n_batch != n_batch_cur)
+        {
+            LOG_INFO("n_batch adjusted", {
+                {"n_batch_old", n_batch_cur},
+                {"n_batch",     n_batch},
+                {"n_batch_fit", n_batch_fit},
+                {"t_per_token", t_per_token.count(n_batch) != 0 ? t_per_token[n_batch] : 0.0},
+            });
+            n_batch_cur = n_batch;
+        }
+
+        // the chunk can never be larger than the free space left in the KV cache
+        if (n_kv_free > 0 && n_kv_free < n_batch)
+        {
+            LOG_VERBOSE("n_batch limited by free KV cells", {
+                {"n_batch",   n_batch},
+                {"n_kv_free", n_kv_free},
+            });
+            n_batch = n_kv_free;
+        }
+
+        return n_batch;
+    }
+
+    // only a failure of the proposed n_batch lowers the limit: a chunk clamped to the free KV cells
+    // failing says nothing about it, so that chunk and its halves are retried without touching the limit
+    int32_t on_decode_failure(int32_t n_batch) {
+        if (n_batch != n_batch_cur)
+        {
+            LOG_VERBOSE("failed to find free space in the KV cache for a clamped chunk, retrying smaller", {
+                {"n_batch_failed", n_batch},
+                {"n_batch_fit",    n_batch_fit},
+            });
+            return std::max(1, n_batch / 2);
+        }
+
+        n_batch_fit = std::max(1, std::min(n_batch_fit, n_batch / 2));
+        n_batch_cur = n_batch_fit;
+        n_success   = 0;
+
+        LOG_WARNING("failed to find free space in the KV cache, lowering n_batch", {
+            {"n_batch_failed", n_batch},
+            {"n_batch",        n_batch_fit},
+        });
+
+        return n_batch_fit;
+    }
+
+    // whether the decode of this chunk should be timed: chunks clamped to the free KV cells
+    // are not sizes the controller chose, and tail chunks say nothing about the throughput
+    bool should_time(int32_t n_batch, int32_t n_tokens) {
+        if (n_batch != n_batch_cur || n_tokens != n_batch)
+        {
+            return false;
+        }
+        return n_timed++ % n_time_every == 0;
+    }
+
+    // t_us < 0 when the decode was not timed
+    void on_decode_success(int32_t n_batch, int32_t n_tokens, int64_t t_us) {
+        if (n_tokens < n_batch || n_tokens <= 0)
+        {
+            return;
+        }
+
+        if (t_us >= 0)
+        {
+            const double t = (double) t_us / n_tokens;
+            auto it = t_per_token.find(n_batch);
+            if (it == t_per_token.end())
+            {
+                t_per_token[n_batch] = t;
+            }
+            else
+            {
+                it->second = 0.8 * it->second + 0.2 * t;
+            }
+        }
+
+        // fragmentation goes away as sequences are released, so the limit is not permanent
+        if (++n_success >= n_probe && n_batch_fit < n_batch_max)
+        {
+            const int32_t n_batch_old = n_batch_fit;
+            n_batch_fit = std::min(n_batch_max, n_batch_fit * 2);
+            n_success   = 0;
+
+            LOG_INFO("probing larger n_batch", {
+                {"n_batch_old", n_batch_old},
+                {"n_batch_fit", n_batch_fit},
+            });
+        }
+    }
+};
+
+// paged view of the KV cache
+//
+// cells are accounted in blocks per sequence; running sequences also hold the blocks reserved
+// for the tokens they are still allowed to generate, so that admission can be decided up front
+struct llama_kv_accounting {
+    int32_t n_cells  = 0;  // total cells (n_ctx)
+    int32_t n_block  = 16; // cells per block
+    int32_t n_shared = 0;  // cells of the system prompt, shared by all sequences
+
+    std::vector<int32_t> seq_cells;    // cells holding the tokens of each sequence
+    std::vector<int32_t> seq_reserved; // cells reserved for the next tokens of each sequence
+
+    void init(int32_t n_ctx, int32_t n_seq) {
+        n_cells = n_ctx;
+        seq_cells.assign(n_seq, 0);
+        seq_reserved.assign(n_seq, 0);
+    }
+
+    int32_t n_blocks(int32_t cells) const {
+        return (cells + n_block - 1) / n_block;
+    }
+
+    int32_t n_blocks_total() const {
+        return n_cells / n_block;
     }
+
+    int32_t n_blocks_seq(llama_seq_id seq_id) const {
+        return n_blocks(seq_cells[seq_id] + seq_reserved[seq_id]);
+    }
+
+    int32_t n_blocks_free() const {
+        int32_t n_used = n_blocks(n_shared);
+        for (size_t i = 0; i < seq_cells.size(); i++)
+        {
+            n_used += n_blocks_seq(i);
+        }
+        return n_blocks_total() - n_used;
+    }
+
+    // whether a sequence can be resized to n_tokens cells plus n_reserve reserved ones
+    bool seq_fits(llama_seq_id seq_id, int32_t n_tokens, int32_t n_reserve) const {
+        return n_blocks(n_tokens + n_reserve) - n_blocks_seq(seq_id) <= n_blocks_free();
+    }
+
+    void seq_set(llama_seq_id seq_id, int32_t n_tokens, int32_t n_reserve) {
+        seq_cells[seq_id]    = n_tokens;
+        seq_reserved[seq_id] = n_reserve;
+    }
+};
+
+// a system prompt decoded once into a sequence of its own, slots share its cells through llama_kv_cache_seq_cp
+struct llama_system_prompt {
+    std::string key; // name of the system prompt, or its text when unnamed
+    std::vector<llama_token> tokens;
+
+    llama_seq_id seq_id = -1;
+    bool loaded = false;
+
+    int64_t t_last_used = -1;
+};
+
+// an input of the embedding-only mode, waiting to be packed into a batch
+struct llama_embedding_input {
+    int task_id;
+    int multitask_id;
+    std::vector<llama_token> tokens;
 };
 
 struct llama_server_context
@@ -409,17 +713,27 @@ struct llama_server_context
 
     int32_t n_ctx;  // total context for all clients / slots
 
-    // system prompt
-    bool system_need_update = false;
+    llama_vocab_pieces vocab_pieces;
 
-    std::string              system_prompt;
-    std::vector<llama_token> system_tokens;
+    // end-of-generation tokens, eos and the ones chat templates end a turn with
+    std::vector<llama_token> eog_tokens;
+
+    // relevance tokens of the rerank prompts of causal models
+    llama_token rerank_yes = -1;
+    llama_token rerank_no  = -1;
+
+    // cached system prompts, at most srv_params.n_system_prompts
+    std::vector<llama_system_prompt> system_prompts;
 
     std::string name_user;      // this should be the antiprompt
     std::string name_assistant;
 
     // slots / clients
     std::vector<llama_client_slot> slots;
+    std::vector<llama_client_slot> swapped_slots; // preempted to serve higher priority tasks
+
+    // embedding-only mode: the inputs waiting for a batch
+    std::vector<llama_embedding_input> embedding_inputs;
     json default_generation_settings_for_props;
 
     llama_server_queue queue_tasks;
@@ -427,8 +741,37 @@ struct llama_server_context
 
     llama_metrics metrics;
 
+    llama_batch_controller batch_controller;
+
+    llama_kv_accounting kv;
+
+    llama_grammar_cache grammar_cache;
+    llama_grammar_trie  grammar_trie;
+
+    llama_worker_pool sampling_pool;
+    std::vector<llama_client_slot *> sampling_slots;
+    std::vector<const float *> sampling_logits;
+
+    // logits of the forked prompts of the current batch, the samplers of the completions that share
+    // them each start from the original values (logit biases are applied in place)
+    struct fork_logits
+    {
+        int32_t i_batch;
+        std::vector<float> logits;
+    };
+    std::vector<fork_logits> fork_rows;
+
+    std::vector<llama_client_slot *> beam_slots;
+
+    server_params srv_params;
+
     ~llama_server_context()
     {
+        // the files of the slots still swapped out
+        for (llama_client_slot &slot : swapped_slots)
+        {
+            slot.reset();
+        }
         if (ctx)
         {
             llama_free(ctx);
@@ -441,9 +784,10 @@ struct llama_server_context
         }
     }
 
-    bool load_model(const gpt_params &params_)
+    bool load_model(const gpt_params &params_, const server_params &srv_params_)
     {
         params = params_;
+        srv_params = srv_params_;
         if (!params.mmproj.empty()) {
             multimodal = true;
             LOG_INFO("Multi Modal Mode Enabled", {});
@@ -458,7 +802,28 @@ struct llama_server_context
             }
         }
 
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
+        // the cached system prompts use the sequences after those of the slots
+        gpt_params params_ctx = params;
+        params_ctx.n_parallel += srv_params.n_system_prompts;
+
+        // a sequence is pooled within one ubatch, so a prompt that fits in a batch is embedded whole
+        if (params.embedding)
+        {
+            params_ctx.n_ubatch = params_ctx.n_batch;
+        }
+
+        // the embedding-only mode packs each input of a batch in a sequence of its own
+        if (srv_params.embedding_only && !params.embedding)
+        {
+            LOG_WARNING("the embedding-only mode needs a model loaded with embeddings", {});
+            srv_params.embedding_only = false;
+        }
+        if (srv_params.embedding_only)
+        {
+            params_ctx.n_parallel = std::max(params_ctx.n_parallel, srv_params.n_embedding_seqs);
+        }
+
+        std::tie(model, ctx) = llama_init_from_gpt_params(params_ctx);
         if (model == nullptr)
         {
             LOG_ERROR("unable to load model", {{"model", params.model}});
@@ -480,9 +845,99 @@ struct llama_server_context
 
         add_bos_token = llama_should_add_bos_token(model);
 
+        init_eog_tokens();
+        init_rerank_tokens();
+
+        vocab_pieces.init(ctx);
+        grammar_trie.init(vocab_pieces, llama_n_vocab(model));
+
         return true;
     }
 
+    void init_eog_tokens() {
+        eog_tokens.clear();
+        eog_tokens.push_back(llama_token_eos(model));
+
+        // the end-of-turn tokens of the common chat templates; other control tokens (tool calls,
+        // headers, images, infill) can appear in the middle of an answer and do not end it
+        static const std::vector<std::string> end_of_turn = { "<|eot_id|>", "<|im_end|>", "<end_of_turn>", "<|end|>" };
+        const int32_t n_vocab = llama_n_vocab(model);
+        for (llama_token tok = 0; tok < n_vocab; tok++)
+        {
+            const char *text = llama_token_get_text(model, tok);
+            const bool is_eog = std::find(end_of_turn.begin(), end_of_turn.end(), text) != end_of_turn.end() ||
+                                std::find(srv_params.eog_tokens.begin(), srv_params.eog_tokens.end(), text) != srv_params.eog_tokens.end();
+            if (is_eog && tok != eog_tokens.front())
+            {
+                eog_tokens.push_back(tok);
+            }
+        }
+
+        LOG_INFO("end-of-generation tokens", {{"tokens", eog_tokens}});
+    }
+
+    void init_rerank_tokens() {
+        const std::vector<llama_token> yes = ::llama_tokenize(ctx, srv_params.rerank_yes, false, true);
+        const std::vector<llama_token> no  = ::llama_tokenize(ctx, srv_params.rerank_no,  false, true);
+        rerank_yes = yes.empty() ? -1 : yes.back();
+        rerank_no  = no.empty()  ? -1 : no.back();
+    }
+
+    bool is_eog_token(llama_token tok) const {
+        return std::find(eog_tokens.begin(), eog_tokens.end(), tok) != eog_tokens.end();
+    }
+
+    // index of the stop token sequence completed by tok, -1 if none
+    static int32_t find_stop_tokens(const llama_client_slot &slot, llama_token tok) {
+        const std::vector<stop_token_sequence> &stops = slot.params.stop_tokens;
+        for (size_t k = 0; k < stops.size(); k++)
+        {
+            const std::vector<llama_token> &seq = stops[k].tokens;
+
+            // the previous tokens of the sequence must have been generated, not be part of the prompt
+            if (seq.back() != tok || (int32_t) seq.size() > slot.n_decoded || seq.size() - 1 > slot.cache_tokens.size())
+            {
+                continue;
+            }
+            if (std::equal(seq.begin(), seq.end() - 1, slot.cache_tokens.end() - (seq.size() - 1)))
+            {
+                return k;
+            }
+        }
+        return -1;
+    }
+
+    // bytes of the pieces of the last n generated tokens before the current one, they are the
+    // end of slot.generated_text
+    size_t generated_tokens_text_size(const llama_client_slot &slot, size_t n) const {
+        size_t n_bytes = 0;
+        for (size_t j = 1; j <= n && j <= slot.cache_tokens.size(); j++)
+        {
+            n_bytes += vocab_pieces.get(slot.cache_tokens[slot.cache_tokens.size() - j]).size();
+        }
+        return n_bytes;
+    }
+
+    // number of generated tokens, tok included, that are a proper prefix of a stop token sequence:
+    // their text is held back like a partial stop string until the sequence completes or breaks
+    static size_t find_partial_stop_tokens(const llama_client_slot &slot, llama_token tok) {
+        size_t n_best = 0;
+        for (const stop_token_sequence &stop : slot.params.stop_tokens)
+        {
+            const std::vector<llama_token> &seq = stop.tokens;
+            for (size_t k = std::min(seq.size() - 1, (size_t) std::max(slot.n_decoded, 0)); k > n_best; k--)
+            {
+                if (k - 1 <= slot.cache_tokens.size() && seq[k - 1] == tok &&
+                    std::equal(seq.begin(), seq.begin() + (k - 1), slot.cache_tokens.end() - (k - 1)))
+                {
+                    n_best = k;
+                    break;
+                }
+            }
+        }
+        return n_best;
+    }
+
     void validate_model_chat_template(server_params & sparams) {
         llama_chat_message chat[] = {{"user", "test"}};
         std::vector<char> buf(1);
@@ -497,9 +952,14 @@ struct llama_server_context
         // create slots
         all_slots_are_idle = true;
 
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        // with an elastic context every sequence can grow up to the whole KV cache,
+        // admission is then decided on the free cells (see kv_admit)
+        const int32_t n_ctx_slot = srv_params.elastic_ctx ? n_ctx : n_ctx / params.n_parallel;
 
-        LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
+        LOG_INFO("initializing slots", {
+            {"n_slots",     params.n_parallel},
+            {"elastic_ctx", srv_params.elastic_ctx}
+        });
         for (int i = 0; i < params.n_parallel; i++)
         {
             llama_client_slot slot;
@@ -536,12 +996,22 @@ struct llama_server_context
             slot.reset();
 
             slots.push_back(slot);
+            slots.back().cache_tokens.reserve(slot.n_ctx);
         }
 
         default_generation_settings_for_props = get_formated_generation(slots.front());
         default_generation_settings_for_props["seed"] = -1;
 
         batch = llama_batch_init(n_ctx, 0, params.n_parallel);
+
+        batch_controller.init(params.n_batch);
+
+        kv.init(n_ctx, params.n_parallel);
+
+        if (srv_params.n_sampling_threads > 0)
+        {
+            sampling_pool.start(srv_params.n_sampling_threads);
+        }
     }
 
     std::vector<llama_token> tokenize(const json & json_prompt, bool add_bos) const
@@ -639,6 +1109,7 @@ struct llama_server_context
         slot->sparams.mirostat_eta      = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
         slot->sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
         slot->params.n_keep             = json_value(data, "n_keep",            slot->params.n_keep);
+        slot->params.priority           = json_value(data, "priority",          default_params.priority);
         slot->params.seed               = json_value(data, "seed",              default_params.seed);
         slot->sparams.grammar           = json_value(data, "grammar",           default_sparams.grammar);
         slot->sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
@@ -653,6 +1124,8 @@ struct llama_server_context
             slot->params.n_predict = slot->n_predict;
         }
 
+        slot->reserve_buffers(slot->params.n_predict != -1 ? slot->params.n_predict : params.n_predict, slot->sparams.n_probs);
+
         // infill
         if (data.count("input_prefix") != 0)
         {
@@ -721,7 +1194,10 @@ struct llama_server_context
 
         if (json_value(data, "ignore_eos", false))
         {
-            slot->sparams.logit_bias[llama_token_eos(model)] = -INFINITY;
+            for (const llama_token tok : eog_tokens)
+            {
+                slot->sparams.logit_bias[tok] = -INFINITY;
+            }
         }
 
         const auto &logit_bias = data.find("logit_bias");
@@ -767,18 +1243,54 @@ struct llama_server_context
         }
 
         slot->params.antiprompt.clear();
+        slot->params.stop_tokens.clear();
 
         const auto &stop = data.find("stop");
         if (stop != data.end() && stop->is_array())
         {
             for (const auto &word : *stop)
             {
-                if (!word.empty())
+                if (word.empty())
+                {
+                    continue;
+                }
+
+                // a control token such as <|eot_id|> never shows up in the text, stop on its id instead
+                const std::vector<llama_token> toks = ::llama_tokenize(ctx, word.get<std::string>(), false, true);
+                if (toks.size() == 1 && llama_token_get_type(model, toks[0]) == LLAMA_TOKEN_TYPE_CONTROL)
+                {
+                    slot->params.stop_tokens.push_back({ toks, word });
+                }
+                else
                 {
                     slot->params.antiprompt.push_back(word);
                 }
             }
         }
+        slot->stop_matcher.build(slot->params.antiprompt);
+
+        // token id sequences, a single id or an array of ids each
+        const auto &stop_tokens = data.find("stop_tokens");
+        if (stop_tokens != data.end() && stop_tokens->is_array())
+        {
+            for (const auto &el : *stop_tokens)
+            {
+                stop_token_sequence seq;
+                if (el.is_number_integer())
+                {
+                    seq.tokens.push_back(el.get<llama_token>());
+                }
+                else if (el.is_array())
+                {
+                    seq.tokens = el.get<std::vector<llama_token>>();
+                }
+                if (!seq.tokens.empty())
+                {
+                    seq.word = tokens_to_str(vocab_pieces, seq.tokens.cbegin(), seq.tokens.cend());
+                    slot->params.stop_tokens.push_back(seq);
+                }
+            }
+        }
 
         const auto &samplers_sequence = data.find("samplers");
         if (samplers_sequence != data.end() && samplers_sequence->is_array())
@@ -874,9 +1386,32 @@ struct llama_server_context
         if (slot->ctx_sampling != nullptr)
         {
             llama_sampling_free(slot->ctx_sampling);
+            slot->ctx_sampling = nullptr;
+        }
+
+        // the grammar is parsed once per distinct text, the sampling context gets a copy of the compiled state
+        const llama_grammar_cache::entry *grammar = nullptr;
+        if (!slot->sparams.grammar.empty())
+        {
+            grammar = grammar_cache.get(slot->sparams.grammar);
+            if (grammar == nullptr)
+            {
+                LOG_ERROR("failed to parse grammar", {{"slot_id", slot->id}, {"task_id", slot->task_id}});
+                return false;
+            }
+        }
+
+        llama_sampling_params sparams_no_grammar = slot->sparams;
+        sparams_no_grammar.grammar.clear();
+        slot->ctx_sampling = llama_sampling_init(sparams_no_grammar);
+        if (grammar != nullptr)
+        {
+            slot->ctx_sampling->params.grammar = slot->sparams.grammar;
+            slot->ctx_sampling->parsed_grammar = grammar->parsed;
+            slot->ctx_sampling->grammar        = llama_grammar_copy(grammar->grammar);
         }
-        slot->ctx_sampling = llama_sampling_init(slot->sparams);
         llama_set_rng_seed(ctx, slot->params.seed);
+        slot->fused_sampler.seed(slot->params.seed);
         slot->command = LOAD_PROMPT;
 
         all_slots_are_idle = false;
@@ -889,395 +1424,1142 @@ struct llama_server_context
         return true;
     }
 
+    // llama_sampling_reset, starting the grammar again from the cached compiled state
+    void sampling_reset(llama_client_slot &slot) {
+        llama_sampling_context *ctx_sampling = slot.ctx_sampling;
+
+        grammar_parser::parse_state parsed = std::move(ctx_sampling->parsed_grammar);
+        ctx_sampling->parsed_grammar = {};
+        llama_sampling_reset(ctx_sampling);
+        ctx_sampling->parsed_grammar = std::move(parsed);
+
+        if (!ctx_sampling->params.grammar.empty())
+        {
+            const llama_grammar_cache::entry *grammar = grammar_cache.get(ctx_sampling->params.grammar);
+            ctx_sampling->grammar = grammar != nullptr ? llama_grammar_copy(grammar->grammar) : nullptr;
+        }
+    }
+
     void kv_cache_clear() {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
     }
 
-    void update_system_prompt() {
-        kv_cache_clear();
-        system_tokens.clear();
-
-        if (!system_prompt.empty()) {
-            system_tokens = ::llama_tokenize(ctx, system_prompt, add_bos_token);
+    // drop the cached prompt of a slot that is not running, keeping the shared system prompt
+    void kv_evict_slot(llama_client_slot &slot) {
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.system_tokens.size(), -1);
+        slot.cache_tokens.clear();
+        slot.n_past    = 0;
+        slot.n_past_se = 0;
+        kv.seq_set(slot.id, 0, 0);
+    }
 
-            llama_batch_clear(batch);
+    // cells to reserve for a sequence of n_tokens that already generated n_decoded tokens:
+    // its remaining budget when known, otherwise one block ahead
+    int32_t kv_n_reserve(const llama_client_slot &slot, int32_t n_tokens, int32_t n_decoded) const {
+        const int32_t n_predict = slot.params.n_predict != -1 ? slot.params.n_predict : params.n_predict;
+        const int32_t n_room    = slot.n_ctx - (int32_t) slot.system_tokens.size() - n_tokens;
+        const int32_t n_reserve = n_predict != -1 ? n_predict - n_decoded : kv.n_block;
+        return std::max(0, std::min(n_reserve, n_room));
+    }
 
-            for (int i = 0; i < (int)system_tokens.size(); ++i)
+    // refresh the accounting from the state of the slots
+    void kv_sync() {
+        kv.n_shared = 0;
+        for (const llama_system_prompt &sys : system_prompts)
+        {
+            kv.n_shared += sys.tokens.size();
+        }
+        for (const llama_client_slot &slot : slots)
+        {
+            if (slot.preempted)
             {
-                llama_batch_add(batch, system_tokens[i], i, { 0 }, false);
+                kv.seq_set(slot.id, 0, 0);
             }
-
-            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += params.n_batch)
+            else if (slot.state == PROCESSING)
             {
-                const int32_t n_tokens = std::min(params.n_batch, (int32_t) (batch.n_tokens - i));
-                llama_batch batch_view = {
-                    n_tokens,
-                    batch.token    + i,
-                    nullptr,
-                    batch.pos      + i,
-                    batch.n_seq_id + i,
-                    batch.seq_id   + i,
-                    batch.logits   + i,
-                    0, 0, 0, // unused
-                };
-                if (llama_decode(ctx, batch_view) != 0)
-                {
-                    LOG_TEE("%s: llama_decode() failed\n", __func__);
-                    return;
-                }
+                kv.seq_set(slot.id, slot.n_past, kv_n_reserve(slot, slot.n_past, slot.n_decoded));
             }
-
-            // assign the system KV cache to all parallel sequences
-            for (int32_t i = 1; i < params.n_parallel; ++i)
+            else
             {
-                llama_kv_cache_seq_cp(ctx, 0, i, 0, system_tokens.size());
+                kv.seq_set(slot.id, slot.cache_tokens.size(), 0);
             }
         }
+    }
 
-        LOG_TEE("system prompt updated\n");
-        system_need_update = false;
+    static bool kv_can_preempt(const llama_client_slot &slot) {
+        // self-extended positions and image embeddings cannot be rebuilt from the cached tokens,
+        // which is the fallback when the state cannot be saved
+        return slot.state == PROCESSING && slot.command != RELEASE && !slot.preempted &&
+               slot.ga_n == 1 && slot.images.empty() && slot.n_decoded > 0 && slot.beam_leader < 0;
     }
 
-    void notify_system_prompt_changed() {
-        // release all slots
-        for (llama_client_slot &slot : slots)
+    // save the KV cells of a sequence to host memory, or to a file under srv_params.swap_path
+    bool kv_swap_out(llama_client_slot &slot) {
+        const size_t n_state = llama_state_seq_get_size(ctx, slot.id);
+        if (n_state == 0)
         {
-            slot.release();
+            return false;
         }
 
-        system_need_update = true;
-    }
-
-    void process_system_prompt_data(const json &sys_props) {
-        system_prompt  = sys_props.value("prompt", "");
-        name_user      = sys_props.value("anti_prompt", "");
-        name_assistant = sys_props.value("assistant_name", "");
-
-
-        notify_system_prompt_changed();
-    }
-
-    static size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
-                                        const stop_type type, llama_client_slot &slot)
-    {
-        size_t stop_pos = std::string::npos;
+        slot.swap_state.resize(n_state);
+        if (llama_state_seq_get_data(ctx, slot.swap_state.data(), slot.id) != n_state)
+        {
+            slot.swap_state.clear();
+            return false;
+        }
 
-        for (const std::string &word : slot.params.antiprompt)
+        if (!srv_params.swap_path.empty())
         {
-            size_t pos;
-            if (type == STOP_FULL)
+            // the directory may be shared by several backends, mkstemp gives each file a unique name
+            std::string path = srv_params.swap_path + "/slot-" + std::to_string(getpid()) + "-XXXXXX";
+            const int fd = mkstemp(&path[0]);
+            FILE *f = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+            const bool ok = f != nullptr && fwrite(slot.swap_state.data(), 1, n_state, f) == n_state;
+            if (f != nullptr)
             {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
+                fclose(f);
             }
-            else
+            else if (fd >= 0)
             {
-                pos = find_partial_stop_string(word, text);
+                close(fd);
             }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
+            if (!ok)
             {
-                if (type == STOP_FULL)
+                LOG_WARNING("failed to write the slot state, keeping it in memory", {{"path", path}});
+                if (fd >= 0)
                 {
-                    slot.stopped_word = true;
-                    slot.stopping_word = word;
-                    slot.has_next_token = false;
+                    std::remove(path.c_str());
                 }
-                stop_pos = pos;
+                return true;
             }
+            slot.swap_file = path;
+            slot.swap_state.clear();
+            slot.swap_state.shrink_to_fit();
         }
 
-        return stop_pos;
+        LOG_VERBOSE("slot state saved", {
+            {"slot_id", slot.id},
+            {"n_state", n_state},
+            {"file",    slot.swap_file}
+        });
+        return true;
     }
 
-    bool process_token(completion_token_output &result, llama_client_slot &slot) {
-        // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = llama_token_to_piece(ctx, result.tok);
-        slot.sampled = result.tok;
-
-        // search stop word and delete it
-        slot.generated_text += token_str;
-        slot.has_next_token = true;
+    // restore the KV cells saved by kv_swap_out into the sequence of the slot, the saved state
+    // includes the system prompt so the restored sequence gets its own copy of those cells
+    bool kv_swap_in(llama_client_slot &slot) {
+        if (!slot.swap_file.empty())
+        {
+            FILE *f = fopen(slot.swap_file.c_str(), "rb");
+            bool ok = f != nullptr && fseek(f, 0, SEEK_END) == 0;
+            if (ok)
+            {
+                slot.swap_state.resize(ftell(f));
+                ok = fseek(f, 0, SEEK_SET) == 0 && fread(slot.swap_state.data(), 1, slot.swap_state.size(), f) == slot.swap_state.size();
+            }
+            if (f != nullptr)
+            {
+                fclose(f);
+            }
+            std::remove(slot.swap_file.c_str());
+            slot.swap_file.clear();
+            if (!ok)
+            {
+                slot.swap_state.clear();
+            }
+        }
 
-        if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1)
+        if (slot.swap_state.empty())
         {
-            // we can change penalty_prompt_tokens because it is always created from scratch each request
-            slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
+            return false;
         }
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i)
+        const bool ok = llama_state_seq_set_data(ctx, slot.swap_state.data(), slot.id) != 0;
+        slot.swap_state.clear();
+        slot.swap_state.shrink_to_fit();
+        return ok;
+    }
+
+    // free the KV cells of a running sequence, they are restored from the saved state when resumed,
+    // or recomputed from the cached tokens if it could not be saved
+    void kv_preempt_slot(llama_client_slot &slot) {
+        const bool saved = kv_swap_out(slot);
+        LOG_INFO("preempting slot", {
+            {"slot_id",        slot.id},
+            {"task_id",        slot.task_id},
+            {"priority",       slot.params.priority},
+            {"n_cache_tokens", slot.cache_tokens.size()},
+            {"state_saved",    saved}
+        });
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.system_tokens.size(), -1);
+        slot.preempted         = true;
+        slot.preempt_requested = false;
+        slot.i_batch           = -1;
+        kv.seq_set(slot.id, 0, 0);
+    }
+
+    // lowest priority first, then the most recently started
+    llama_client_slot * kv_preemption_victim(int32_t priority) {
+        llama_client_slot *victim = nullptr;
+        for (llama_client_slot &slot : slots)
         {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80)
+            if (!kv_can_preempt(slot) || slot.preempt_requested || slot.params.priority >= priority)
             {
-                // continuation byte: 10xxxxxx
                 continue;
             }
-            if ((c & 0xE0) == 0xC0)
+            if (victim == nullptr || slot.params.priority < victim->params.priority ||
+                (slot.params.priority == victim->params.priority && slot.t_start_process_prompt > victim->t_start_process_prompt))
             {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
+                victim = &slot;
             }
-            else if ((c & 0xF0) == 0xE0)
+        }
+        return victim;
+    }
+
+    // elastic context admission: the prompt and the reservation for its generation must fit in the free blocks.
+    // idle prompt caches are evicted first, then lower priority sequences are asked to yield their cells
+    bool kv_admit(llama_client_slot &slot, const std::vector<llama_token> &prompt_tokens) {
+        const int32_t n_cached  = slot.params.cache_prompt ? (int32_t) common_part(slot.cache_tokens, prompt_tokens) : 0;
+        const int32_t n_tokens  = prompt_tokens.size();
+        const int32_t n_reserve = kv_n_reserve(slot, n_tokens, 0);
+
+        // the part of the old cache that does not match the prompt is removed on admission
+        const int32_t n_cells_old = kv.seq_cells[slot.id];
+        kv.seq_set(slot.id, n_cached, 0);
+
+        if (kv.seq_fits(slot.id, n_tokens, n_reserve))
+        {
+            kv.seq_set(slot.id, n_tokens, n_reserve);
+            return true;
+        }
+
+        for (llama_client_slot &other : slots)
+        {
+            if (other.id != slot.id && other.available() && !other.cache_tokens.empty())
             {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
+                LOG_VERBOSE("evicting idle slot cache", {
+                    {"slot_id",        other.id},
+                    {"n_cache_tokens", other.cache_tokens.size()}
+                });
+                kv_evict_slot(other);
             }
-            else if ((c & 0xF8) == 0xF0)
+        }
+
+        if (kv.seq_fits(slot.id, n_tokens, n_reserve))
+        {
+            kv.seq_set(slot.id, n_tokens, n_reserve);
+            return true;
+        }
+
+        // nothing else will free cells, let llama_decode deal with it
+        bool any_running = false;
+        for (const llama_client_slot &other : slots)
+        {
+            any_running = any_running || (other.id != slot.id && other.state == PROCESSING && !other.preempted);
+        }
+        if (!any_running && batch.n_tokens == 0)
+        {
+            kv.seq_set(slot.id, n_tokens, n_reserve);
+            return true;
+        }
+
+        // the running sequences already have their next token in the batch, so the victims
+        // are preempted at the beginning of the next update and the prompt is admitted then
+        int32_t n_blocks_freed = 0;
+        const int32_t n_blocks_needed = kv.n_blocks(n_tokens + n_reserve) - kv.n_blocks_seq(slot.id) - kv.n_blocks_free();
+        while (n_blocks_freed < n_blocks_needed)
+        {
+            llama_client_slot *victim = kv_preemption_victim(slot.params.priority);
+            if (victim == nullptr)
             {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
+                break;
             }
-            // else 1-byte character or invalid byte
-            break;
+            victim->preempt_requested = true;
+            n_blocks_freed += kv.n_blocks_seq(victim->id);
         }
 
-        if (!incomplete)
+        if (n_blocks_freed < n_blocks_needed)
         {
-            size_t pos = std::min(slot.sent_count, slot.generated_text.size());
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool is_stop_full = false;
-            size_t stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_FULL, slot);
-            if (stop_pos != std::string::npos)
+            // not enough to gain from preemption, keep the victims running
+            for (llama_client_slot &other : slots)
             {
-                is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.sent_count, slot.generated_text.size());
+                other.preempt_requested = false;
             }
-            else
+        }
+
+        LOG_VERBOSE("prompt does not fit in the free KV cells, deferring", {
+            {"slot_id",         slot.id},
+            {"task_id",         slot.task_id},
+            {"n_tokens",        n_tokens},
+            {"n_reserve",       n_reserve},
+            {"n_blocks_free",   kv.n_blocks_free()},
+            {"n_blocks_freed",  n_blocks_freed}
+        });
+
+        kv.seq_cells[slot.id] = n_cells_old;
+        return false;
+    }
+
+    // move a running slot out of the slot array so that its slot can serve another task,
+    // it is swapped back in by swap_in_slots as soon as a slot is available
+    void swap_out_slot(llama_client_slot &slot) {
+        if (!slot.preempted)
+        {
+            kv_preempt_slot(slot);
+        }
+
+        LOG_INFO("slot swapped out", {
+            {"slot_id",  slot.id},
+            {"task_id",  slot.task_id},
+            {"priority", slot.params.priority}
+        });
+
+        swapped_slots.push_back(std::move(slot));
+
+        // the cells of the system prompt stay in the sequence of the slot
+        slot.system_tokens = swapped_slots.back().system_tokens;
+
+        // the sampling context and the images now belong to the swapped copy
+        slot.ctx_sampling = nullptr;
+        slot.images.clear();
+        slot.swap_state.clear();
+        slot.swap_file.clear();
+        slot.cache_tokens.clear();
+        slot.generated_token_probs.clear();
+        slot.preempted         = false;
+        slot.preempt_requested = false;
+        slot.state             = IDLE;
+        slot.command           = NONE;
+        slot.task_id           = -1;
+        slot.multitask_id      = -1;
+        slot.n_past            = 0;
+        slot.n_past_se         = 0;
+        slot.i_batch           = -1;
+    }
+
+    // highest priority first, swapped slots take precedence over new tasks of the same priority
+    void swap_in_slots() {
+        while (!swapped_slots.empty())
+        {
+            auto next = swapped_slots.begin();
+            for (auto it = swapped_slots.begin(); it != swapped_slots.end(); ++it)
             {
-                is_stop_full = false;
-                stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_PARTIAL, slot);
+                if (it->params.priority > next->params.priority)
+                {
+                    next = it;
+                }
             }
 
-            // check if there is any token to predict
-            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0))
+            llama_client_slot *target = nullptr;
+            for (llama_client_slot &slot : slots)
             {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.sent_count += result.text_to_send.size();
-                // add the token to slot queue and cache
+                if (slot.available())
+                {
+                    target = &slot;
+                    break;
+                }
             }
-            slot.add_token_string(result);
-            if (slot.params.stream)
+            if (target == nullptr)
             {
-                send_partial_response(slot, result);
+                return;
             }
-        }
 
-        if (incomplete)
-        {
-            slot.has_next_token = true;
-        }
+            LOG_INFO("slot swapped in", {
+                {"slot_id",     target->id},
+                {"task_id",     next->task_id},
+                {"old_slot_id", next->id}
+            });
 
-        // check the limits
-        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params))
-        {
-            slot.stopped_limit = true;
-            slot.has_next_token = false;
+            const int id = target->id;
+            target->reset();
+            if (target->ctx_sampling != nullptr)
+            {
+                llama_sampling_free(target->ctx_sampling);
+            }
+            llama_kv_cache_seq_rm(ctx, id, -1, -1);
+
+            *target = std::move(*next);
+            target->id = id;
+            swapped_slots.erase(next);
+
+            // the KV cells, system prompt included, are restored by kv_resume_preempted
+            all_slots_are_idle = false;
         }
+    }
 
-        if (result.tok == llama_token_eos(model))
+    int32_t swapped_max_priority() const {
+        int32_t priority = INT32_MIN;
+        for (const llama_client_slot &slot : swapped_slots)
         {
-            slot.stopped_eos = true;
-            slot.has_next_token = false;
-            LOG_VERBOSE("eos token found", {});
+            priority = std::max(priority, slot.params.priority);
         }
-
-        LOG_VERBOSE("next token", {
-                                      {"token", result.tok},
-                                      {"token_text", tokens_to_output_formatted_string(ctx, result.tok)},
-                                      {"has_next_token", slot.has_next_token},
-                                      {"n_remain", slot.n_remaining},
-                                      {"num_tokens_predicted", slot.n_decoded},
-                                      {"stopped_eos", slot.stopped_eos},
-                                      {"stopped_word", slot.stopped_word},
-                                      {"stopped_limit", slot.stopped_limit},
-                                      {"stopping_word", slot.stopping_word},
-                                  });
-
-        return slot.has_next_token; // continue
+        return priority;
     }
 
-    bool process_images(llama_client_slot &slot) const
-    {
-        for (slot_image &img : slot.images)
+    // restore preempted sequences when they fit again, highest priority first
+    void kv_resume_preempted() {
+        while (true)
         {
-            if (!img.request_encode_image)
+            llama_client_slot *next = nullptr;
+            for (llama_client_slot &slot : slots)
             {
-                continue;
+                if (slot.preempted && slot.command != RELEASE &&
+                    (next == nullptr || slot.params.priority > next->params.priority))
+                {
+                    next = &slot;
+                }
+            }
+            if (next == nullptr)
+            {
+                return;
             }
 
-            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &img.image_embedding, &img.image_tokens)) {
-                LOG_TEE("Error processing the given image");
-                return false;
+            llama_client_slot &slot = *next;
+            const int32_t n_tokens = slot.cache_tokens.size();
+
+            bool any_running = false;
+            for (const llama_client_slot &other : slots)
+            {
+                any_running = any_running || (other.state == PROCESSING && !other.preempted);
+            }
+            if (srv_params.elastic_ctx && any_running && !kv.seq_fits(slot.id, n_tokens, kv_n_reserve(slot, n_tokens, slot.n_decoded)))
+            {
+                return;
             }
 
-            img.request_encode_image = false;
-        }
+            const bool restored = kv_swap_in(slot);
 
-        return slot.images.size() > 0;
-    }
+            LOG_INFO("resuming preempted slot", {
+                {"slot_id",  slot.id},
+                {"task_id",  slot.task_id},
+                {"n_tokens", n_tokens},
+                {"restored", restored}
+            });
 
-    void send_error(task_server& task, const std::string &error)
-    {
-        LOG_TEE("task %i - error: %s\n", task.id, error.c_str());
-        task_result res;
-        res.id = task.id;
-        res.multitask_id = task.multitask_id;
-        res.stop = false;
-        res.error = true;
-        res.result_json = { { "content", error } };
-        queue_results.send(res);
+            // the last cached token is the sampled one, its logits give the next token
+            const int32_t n_system = slot.system_tokens.size();
+            if (!restored)
+            {
+                // the sequence may have been emptied by swap_in_slots, start over from the system prompt
+                llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                if (!system_prompt_copy(slot))
+                {
+                    for (int32_t i = 0; i < n_system; ++i)
+                    {
+                        llama_batch_add(batch, slot.system_tokens[i], i, { slot.id }, false);
+                    }
+                }
+                for (int32_t i = 0; i < n_tokens - 1; ++i)
+                {
+                    llama_batch_add(batch, slot.cache_tokens[i], n_system + i, { slot.id }, false);
+                }
+            }
+            llama_batch_add(batch, slot.sampled, n_system + n_tokens - 1, { slot.id }, true);
+
+            slot.n_past    = n_tokens;
+            slot.i_batch   = batch.n_tokens - 1;
+            slot.preempted = false;
+            kv.seq_set(slot.id, n_tokens, kv_n_reserve(slot, n_tokens, slot.n_decoded));
+        }
     }
 
-    json get_formated_generation(llama_client_slot &slot)
-    {
-        const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
-        const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
-                                eos_bias->second < 0.0f && std::isinf(eos_bias->second);
-        std::vector<std::string> samplers_sequence;
-        for (const auto &sampler_type : slot.sparams.samplers_sequence)
+    llama_system_prompt * find_system_prompt(const std::string &key) {
+        for (llama_system_prompt &sys : system_prompts)
         {
-            samplers_sequence.emplace_back(sampler_type_to_name_string(sampler_type));
+            if (sys.key == key)
+            {
+                return &sys;
+            }
         }
-
-        return json {
-            {"n_ctx",             slot.n_ctx},
-            {"n_predict",         slot.n_predict},
-            {"model",             params.model_alias},
-            {"seed",              slot.params.seed},
-            {"temperature",       slot.sparams.temp},
-            {"dynatemp_range",    slot.sparams.dynatemp_range},
-            {"dynatemp_exponent", slot.sparams.dynatemp_exponent},
-            {"top_k",             slot.sparams.top_k},
-            {"top_p",             slot.sparams.top_p},
-            {"min_p",             slot.sparams.min_p},
-            {"tfs_z",             slot.sparams.tfs_z},
-            {"typical_p",         slot.sparams.typical_p},
-            {"repeat_last_n",     slot.sparams.penalty_last_n},
-            {"repeat_penalty",    slot.sparams.penalty_repeat},
-            {"presence_penalty",  slot.sparams.penalty_present},
-            {"frequency_penalty", slot.sparams.penalty_freq},
-            {"penalty_prompt_tokens", slot.sparams.penalty_prompt_tokens},
-            {"use_penalty_prompt_tokens", slot.sparams.use_penalty_prompt_tokens},
-            {"mirostat",          slot.sparams.mirostat},
-            {"mirostat_tau",      slot.sparams.mirostat_tau},
-            {"mirostat_eta",      slot.sparams.mirostat_eta},
-            {"penalize_nl",       slot.sparams.penalize_nl},
-            {"stop",              slot.params.antiprompt},
-            {"n_predict",         slot.params.n_predict},
-            {"n_keep",            params.n_keep},
-            {"ignore_eos",        ignore_eos},
-            {"stream",            slot.params.stream},
-            {"logit_bias",        slot.sparams.logit_bias},
-            {"n_probs",           slot.sparams.n_probs},
-            {"min_keep",          slot.sparams.min_keep},
-            {"grammar",           slot.sparams.grammar},
-            {"samplers",          samplers_sequence}
-        };
+        return nullptr;
     }
 
-    void send_partial_response(llama_client_slot &slot, completion_token_output tkn)
-    {
-        task_result res;
-        res.id = slot.task_id;
-        res.multitask_id = slot.multitask_id;
-        res.error = false;
-        res.stop = false;
+    // find or tokenize a system prompt, taking over the least recently used sequence when all are in use;
+    // returns nullptr if every cached system prompt is still waiting to be copied by a slot
+    llama_system_prompt * get_system_prompt(const std::string &key, const std::string &prompt) {
+        std::vector<llama_token> tokens = ::llama_tokenize(ctx, prompt, add_bos_token);
 
-        res.result_json = json
+        llama_system_prompt *sys = find_system_prompt(key);
+        if (sys == nullptr && (int32_t) system_prompts.size() < srv_params.n_system_prompts)
         {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"slot_id",    slot.id},
-            {"multimodal", multimodal}
-        };
-
-        if (slot.sparams.n_probs > 0)
+            llama_system_prompt entry;
+            entry.key    = key;
+            entry.seq_id = params.n_parallel + system_prompts.size();
+            system_prompts.push_back(entry);
+            sys = &system_prompts.back();
+        }
+        else if (sys == nullptr)
         {
-            std::vector<completion_token_output> probs_output = {};
-            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
-            size_t probs_pos      = std::min(slot.sent_token_probs_index,                       slot.generated_token_probs.size());
-            size_t probs_stop_pos = std::min(slot.sent_token_probs_index + to_send_toks.size(), slot.generated_token_probs.size());
-            if (probs_pos < probs_stop_pos)
+            for (llama_system_prompt &other : system_prompts)
             {
-                probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
+                if (system_prompt_pinned(other))
+                {
+                    continue;
+                }
+                if (sys == nullptr || other.t_last_used < sys->t_last_used)
+                {
+                    sys = &other;
+                }
             }
-            slot.sent_token_probs_index = probs_stop_pos;
-            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
+            if (sys == nullptr)
+            {
+                return nullptr;
+            }
+            LOG_VERBOSE("evicting system prompt", {{"seq_id", sys->seq_id}, {"n_tokens", sys->tokens.size()}});
+            sys->key = key;
         }
 
-        if (slot.oaicompat)
+        // a named system prompt can be redefined, slots notice the change through the tokens
+        if (sys->tokens != tokens)
         {
-            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
-            res.result_json["model"] = slot.oaicompat_model;
+            sys->tokens = std::move(tokens);
+            sys->loaded = false;
         }
+        sys->t_last_used = ggml_time_us();
 
-        queue_results.send(res);
+        return sys;
     }
 
-    void send_final_response(llama_client_slot &slot)
-    {
-        task_result res;
-        res.id = slot.task_id;
+    // a system prompt cannot be replaced while a slot has yet to copy it
+    bool system_prompt_pinned(const llama_system_prompt &sys) const {
+        for (const llama_client_slot &slot : slots)
+        {
+            if (slot.command == LOAD_PROMPT && slot.system_key == sys.key)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // decode the system prompts added since the last update into their sequences
+    void update_system_prompts() {
+        for (llama_system_prompt &sys : system_prompts)
+        {
+            if (sys.loaded)
+            {
+                continue;
+            }
+
+            llama_kv_cache_seq_rm(ctx, sys.seq_id, -1, -1);
+            llama_batch_clear(batch);
+
+            for (int i = 0; i < (int)sys.tokens.size(); ++i)
+            {
+                llama_batch_add(batch, sys.tokens[i], i, { sys.seq_id }, false);
+            }
+
+            bool ok = true;
+            for (int32_t i = 0; i < (int32_t) batch.n_tokens && ok; i += params.n_batch)
+            {
+                const int32_t n_tokens = std::min(params.n_batch, (int32_t) (batch.n_tokens - i));
+                llama_batch batch_view = {
+                    n_tokens,
+                    batch.token    + i,
+                    nullptr,
+                    batch.pos      + i,
+                    batch.n_seq_id + i,
+                    batch.seq_id   + i,
+                    batch.logits   + i,
+                    0, 0, 0, // unused
+                };
+                ok = llama_decode(ctx, batch_view) == 0;
+            }
+            llama_batch_clear(batch);
+
+            if (!ok)
+            {
+                // slots waiting for it go on without a system prompt, the sequence is reused first
+                LOG_ERROR("failed to decode the system prompt", {{"seq_id", sys.seq_id}, {"n_tokens", sys.tokens.size()}});
+                llama_kv_cache_seq_rm(ctx, sys.seq_id, -1, -1);
+                sys.key.clear();
+                sys.tokens.clear();
+                sys.t_last_used = -1;
+            }
+            else
+            {
+                LOG_INFO("system prompt cached", {
+                    {"seq_id",   sys.seq_id},
+                    {"n_tokens", sys.tokens.size()}
+                });
+            }
+            sys.loaded = true;
+        }
+    }
+
+    // share the cells of the cached system prompt of the slot with its sequence
+    bool system_prompt_copy(llama_client_slot &slot) {
+        const llama_system_prompt *sys = slot.system_key.empty() ? nullptr : find_system_prompt(slot.system_key);
+        if (sys == nullptr || !sys->loaded || sys->tokens != slot.system_tokens)
+        {
+            return slot.system_tokens.empty();
+        }
+        llama_kv_cache_seq_cp(ctx, sys->seq_id, slot.id, -1, -1);
+        return true;
+    }
+
+    // make the sequence of the slot start with the system prompt requested by its task,
+    // the cached prompt of the slot is kept when the system prompt did not change
+    void system_prompt_attach(llama_client_slot &slot) {
+        llama_system_prompt *sys = slot.system_key.empty() ? nullptr : find_system_prompt(slot.system_key);
+        if (!slot.system_key.empty() && (sys == nullptr || !sys->loaded || sys->tokens.empty()))
+        {
+            LOG_WARNING("system prompt is not cached, ignoring it", {{"slot_id", slot.id}, {"task_id", slot.task_id}});
+            slot.system_key.clear();
+            sys = nullptr;
+        }
+
+        static const std::vector<llama_token> no_tokens;
+        const std::vector<llama_token> &tokens = sys != nullptr ? sys->tokens : no_tokens;
+        if (sys != nullptr)
+        {
+            sys->t_last_used = ggml_time_us();
+        }
+        if (slot.system_tokens == tokens)
+        {
+            return;
+        }
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        slot.system_tokens = tokens;
+        system_prompt_copy(slot);
+
+        slot.cache_tokens.clear();
+        slot.n_past    = 0;
+        slot.n_past_se = 0;
+        kv.seq_set(slot.id, 0, 0);
+    }
+
+    // resolve the system prompt of a task, an empty key means none
+    bool process_system_prompt_data(const json &sys_props, std::string &key) {
+        const std::string prompt = sys_props.value("prompt", "");
+        name_user      = sys_props.value("anti_prompt", "");
+        name_assistant = sys_props.value("assistant_name", "");
+
+        key = sys_props.value("name", "");
+        if (prompt.empty())
+        {
+            key.clear();
+            return true;
+        }
+        if (key.empty())
+        {
+            key = prompt;
+        }
+
+        return get_system_prompt(key, prompt) != nullptr;
+    }
+
+    bool process_token(completion_token_output &result, llama_client_slot &slot) {
+        // remember which tokens were sampled - used for repetition penalties during sampling
+        slot.sampled = result.tok;
+
+        // end-of-generation and stop tokens end the generation without detokenizing
+        const int32_t i_stop = find_stop_tokens(slot, result.tok);
+        if (i_stop >= 0 || is_eog_token(result.tok))
+        {
+            if (i_stop >= 0)
+            {
+                slot.stopped_word  = true;
+                slot.stopping_word = slot.params.stop_tokens[i_stop].word;
+
+                // the text of the tokens before the last one of the sequence was held back, drop it
+                const size_t n_trim = generated_tokens_text_size(slot, slot.params.stop_tokens[i_stop].tokens.size() - 1);
+                slot.generated_text.resize(slot.generated_text.size() - std::min(n_trim, slot.generated_text.size()));
+            }
+            else
+            {
+                slot.stopped_eos = true;
+            }
+            slot.has_next_token = false;
+
+            // the text still held back for a partial stop string is sent with the last token
+            if (slot.sent_count < slot.generated_text.size())
+            {
+                result.text_to_send.assign(slot.generated_text, slot.sent_count, std::string::npos);
+                slot.sent_count += result.text_to_send.size();
+            }
+
+            slot.add_token_string(result);
+            slot.send_pending = slot.params.stream;
+
+            LOG_VERBOSE("stop token found", {
+                {"token",         result.tok},
+                {"stopped_eos",   slot.stopped_eos},
+                {"stopping_word", slot.stopping_word},
+            });
+            return false;
+        }
+
+        const std::string_view token_str = vocab_pieces.get(result.tok);
+
+        // search stop word and delete it
+        slot.generated_text += token_str;
+        slot.stop_matcher.feed(token_str.data(), token_str.size());
+        slot.utf8.feed(token_str.data(), token_str.size());
+        slot.has_next_token = true;
+
+        if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1)
+        {
+            // we can change penalty_prompt_tokens because it is always created from scratch each request
+            slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
+        }
+
+        // check if there is incomplete UTF-8 character at the end
+        const bool incomplete = !slot.utf8.complete();
+
+        if (!incomplete)
+        {
+            // stop positions are relative to the text that was not sent yet
+            size_t pos = std::min(slot.sent_count, slot.generated_text.size());
+            bool is_stop_full = false;
+            size_t stop_pos = std::string::npos;
+            if (slot.stop_matcher.match_pos != std::string::npos)
+            {
+                is_stop_full = true;
+                stop_pos = std::max(slot.stop_matcher.match_pos, pos) - pos;
+                slot.stopped_word = true;
+                slot.stopping_word = slot.params.antiprompt[slot.stop_matcher.match_idx];
+                slot.has_next_token = false;
+                slot.generated_text.erase(
+                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.end());
+                pos = std::min(slot.sent_count, slot.generated_text.size());
+            }
+            else
+            {
+                size_t partial_pos = slot.stop_matcher.partial_pos();
+                const size_t n_partial = find_partial_stop_tokens(slot, result.tok);
+                if (n_partial > 0)
+                {
+                    const size_t n_held = token_str.size() + generated_tokens_text_size(slot, n_partial - 1);
+                    partial_pos = std::min(partial_pos, slot.generated_text.size() - std::min(n_held, slot.generated_text.size()));
+                }
+                if (partial_pos != std::string::npos)
+                {
+                    stop_pos = std::max(partial_pos, pos) - pos;
+                }
+            }
+
+            // check if there is any token to predict
+            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0))
+            {
+                // no send the stop word in the response
+                result.text_to_send.assign(slot.generated_text, pos, std::string::npos);
+                slot.sent_count += result.text_to_send.size();
+                // add the token to slot queue and cache
+            }
+            slot.add_token_string(result);
+            slot.send_pending = slot.params.stream;
+        }
+
+        if (incomplete)
+        {
+            slot.has_next_token = true;
+        }
+
+        // check the limits
+        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params))
+        {
+            slot.stopped_limit = true;
+            slot.has_next_token = false;
+        }
+
+        LOG_VERBOSE("next token", {
+                                      {"token", result.tok},
+                                      {"token_text", tokens_to_output_formatted_string(vocab_pieces, result.tok)},
+                                      {"has_next_token", slot.has_next_token},
+                                      {"n_remain", slot.n_remaining},
+                                      {"num_tokens_predicted", slot.n_decoded},
+                                      {"stopped_eos", slot.stopped_eos},
+                                      {"stopped_word", slot.stopped_word},
+                                      {"stopped_limit", slot.stopped_limit},
+                                      {"stopping_word", slot.stopping_word},
+                                  });
+
+        return slot.has_next_token; // continue
+    }
+
+    bool process_images(llama_client_slot &slot) const
+    {
+        for (slot_image &img : slot.images)
+        {
+            if (!img.request_encode_image)
+            {
+                continue;
+            }
+
+            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &img.image_embedding, &img.image_tokens)) {
+                LOG_TEE("Error processing the given image");
+                return false;
+            }
+
+            img.request_encode_image = false;
+        }
+
+        return slot.images.size() > 0;
+    }
+
+    void send_error(task_server& task, const std::string &error)
+    {
+        LOG_TEE("task %i - error: %s\n", task.id, error.c_str());
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.stop = false;
+        res.error = true;
+        res.result_json = { { "content", error } };
+        queue_results.send(res);
+    }
+
+    json get_formated_generation(llama_client_slot &slot)
+    {
+        const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
+        const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
+                                eos_bias->second < 0.0f && std::isinf(eos_bias->second);
+        std::vector<std::string> samplers_sequence;
+        for (const auto &sampler_type : slot.sparams.samplers_sequence)
+        {
+            samplers_sequence.emplace_back(sampler_type_to_name_string(sampler_type));
+        }
+
+        return json {
+            {"n_ctx",             slot.n_ctx},
+            {"n_predict",         slot.n_predict},
+            {"model",             params.model_alias},
+            {"seed",              slot.params.seed},
+            {"temperature",       slot.sparams.temp},
+            {"dynatemp_range",    slot.sparams.dynatemp_range},
+            {"dynatemp_exponent", slot.sparams.dynatemp_exponent},
+            {"top_k",             slot.sparams.top_k},
+            {"top_p",             slot.sparams.top_p},
+            {"min_p",             slot.sparams.min_p},
+            {"tfs_z",             slot.sparams.tfs_z},
+            {"typical_p",         slot.sparams.typical_p},
+            {"repeat_last_n",     slot.sparams.penalty_last_n},
+            {"repeat_penalty",    slot.sparams.penalty_repeat},
+            {"presence_penalty",  slot.sparams.penalty_present},
+            {"frequency_penalty", slot.sparams.penalty_freq},
+            {"penalty_prompt_tokens", slot.sparams.penalty_prompt_tokens},
+            {"use_penalty_prompt_tokens", slot.sparams.use_penalty_prompt_tokens},
+            {"mirostat",          slot.sparams.mirostat},
+            {"mirostat_tau",      slot.sparams.mirostat_tau},
+            {"mirostat_eta",      slot.sparams.mirostat_eta},
+            {"penalize_nl",       slot.sparams.penalize_nl},
+            {"stop",              slot.params.antiprompt},
+            {"n_predict",         slot.params.n_predict},
+            {"n_keep",            params.n_keep},
+            {"ignore_eos",        ignore_eos},
+            {"stream",            slot.params.stream},
+            {"logit_bias",        slot.sparams.logit_bias},
+            {"n_probs",           slot.sparams.n_probs},
+            {"min_keep",          slot.sparams.min_keep},
+            {"grammar",           slot.sparams.grammar},
+            {"samplers",          samplers_sequence}
+        };
+    }
+
+    void send_partial_response(llama_client_slot &slot, const completion_token_output &tkn)
+    {
+        task_result res;
+        res.id = slot.task_id;
+        res.multitask_id = slot.multitask_id;
+        res.error = false;
+        res.stop = false;
+
+        res.result_json = json
+        {
+            {"content",    tkn.text_to_send},
+            {"stop",       false},
+            {"slot_id",    slot.id},
+            {"multimodal", multimodal}
+        };
+
+        if (slot.sparams.n_probs > 0)
+        {
+            std::vector<completion_token_output> probs_output = {};
+            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
+            size_t probs_pos      = std::min(slot.sent_token_probs_index,                       slot.generated_token_probs.size());
+            size_t probs_stop_pos = std::min(slot.sent_token_probs_index + to_send_toks.size(), slot.generated_token_probs.size());
+            if (probs_pos < probs_stop_pos)
+            {
+                probs_output = slot.generated_token_probs.slice(probs_pos, probs_stop_pos);
+            }
+            slot.sent_token_probs_index = probs_stop_pos;
+            res.result_json["completion_probabilities"] = probs_vector_to_json(vocab_pieces, probs_output);
+        }
+
+        if (slot.oaicompat)
+        {
+            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
+            res.result_json["model"] = slot.oaicompat_model;
+        }
+
+        queue_results.send(res);
+    }
+
+    void send_final_response(llama_client_slot &slot)
+    {
+        task_result res;
+        res.id = slot.task_id;
         res.multitask_id = slot.multitask_id;
         res.error = false;
         res.stop = true;
 
-        res.result_json = json
+        res.result_json = json
+        {
+            {"content",             !slot.params.stream ? slot.generated_text : ""},
+            {"slot_id",             slot.id},
+            {"stop",                true},
+            {"model",               params.model_alias},
+            {"tokens_predicted",    slot.n_decoded},
+            {"tokens_evaluated",    slot.num_prompt_tokens},
+            {"generation_settings", get_formated_generation(slot)},
+            {"prompt",              slot.prompt},
+            {"truncated",           slot.truncated},
+            {"stopped_eos",         slot.stopped_eos},
+            {"stopped_word",        slot.stopped_word},
+            {"stopped_limit",       slot.stopped_limit},
+            {"stopping_word",       slot.stopping_word},
+            {"tokens_cached",       slot.n_past},
+            {"timings",             slot.get_formated_timings()}
+        };
+
+        if (slot.sparams.n_probs > 0)
+        {
+            std::vector<completion_token_output> probs = {};
+            if (!slot.params.stream && slot.stopped_word)
+            {
+                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
+                const size_t n_probs = slot.generated_token_probs.size();
+                probs = slot.generated_token_probs.slice(0, n_probs - std::min(n_probs, stop_word_toks.size()));
+            }
+            else
+            {
+                probs = slot.generated_token_probs.slice(0, slot.generated_token_probs.size());
+            }
+            res.result_json["completion_probabilities"] = probs_vector_to_json(vocab_pieces, probs);
+        }
+
+        if (slot.oaicompat)
+        {
+            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
+            res.result_json["model"] = slot.oaicompat_model;
+        }
+
+        queue_results.send(res);
+    }
+
+    // embedding of the prompt of a slot, pooled over its sequence, or the one of its last token at
+    // the batch index idx when the model does not pool
+    void send_embedding(llama_client_slot &slot, int32_t idx)
+    {
+        send_embedding(slot.task_id, slot.multitask_id, slot.id, idx, slot.num_prompt_tokens);
+    }
+
+    void send_embedding(int task_id, int multitask_id, llama_seq_id seq_id, int32_t idx, int32_t n_tokens)
+    {
+        const int n_embd = llama_n_embd(model);
+        const float *data = llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE ? llama_get_embeddings_ith(ctx, idx)
+                                                                                : llama_get_embeddings_seq(ctx, seq_id);
+        if (data == nullptr)
+        {
+            task_server task;
+            task.id = task_id;
+            task.multitask_id = multitask_id;
+            send_error(task, "failed to get the embedding");
+            return;
+        }
+
+        std::vector<float> embedding(data, data + n_embd);
+        if (srv_params.normalize_embeddings)
+        {
+            double sum = 0.0;
+            for (const float x : embedding)
+            {
+                sum += (double) x * x;
+            }
+            const float scale = sum > 0.0 ? (float) (1.0 / std::sqrt(sum)) : 0.0f;
+            for (float &x : embedding)
+            {
+                x *= scale;
+            }
+        }
+
+        task_result res;
+        res.id = task_id;
+        res.multitask_id = multitask_id;
+        res.error = false;
+        res.stop = true;
+        res.result_json = json
+        {
+            {"embedding", embedding},
+            {"tokens_evaluated", n_tokens},
+        };
+        queue_results.send(res);
+    }
+
+    // tokens of texts, tokenized by several threads: the vocabulary is only read
+    std::vector<std::vector<llama_token>> tokenize_texts(const std::vector<std::string> &texts) const
+    {
+        std::vector<std::vector<llama_token>> tokens(texts.size());
+        const size_t n_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), (texts.size() + 63) / 64);
+        const auto job = [&](size_t t) {
+            for (size_t i = texts.size() * t / n_threads; i < texts.size() * (t + 1) / n_threads; i++)
+            {
+                tokens[i] = ::llama_tokenize(model, texts[i], add_bos_token, true);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < n_threads; t++)
+        {
+            threads.emplace_back(job, t);
+        }
+        if (n_threads > 0)
+        {
+            job(0);
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        return tokens;
+    }
+
+    // embedding tasks of tokenized inputs, posted together
+    void request_embeddings(const std::vector<int> &task_ids, std::vector<std::vector<llama_token>> &inputs)
+    {
+        std::vector<task_server> tasks(task_ids.size());
+        for (size_t i = 0; i < task_ids.size(); i++)
+        {
+            tasks[i].id = task_ids[i];
+            tasks[i].target_id = 0;
+            tasks[i].data = { {"prompt", std::move(inputs[i])}, {"n_predict", 0} };
+            tasks[i].infill_mode = false;
+            tasks[i].embedding_mode = true;
+            tasks[i].type = TASK_TYPE_COMPLETION;
+            tasks[i].multitask_id = -1;
+        }
+        queue_tasks.post(tasks);
+    }
+
+    // embedding-only mode: the prompt of an embedding task waits to be packed into a batch
+    void queue_embedding(task_server &task)
+    {
+        if (!task.embedding_mode)
         {
-            {"content",             !slot.params.stream ? slot.generated_text : ""},
-            {"slot_id",             slot.id},
-            {"stop",                true},
-            {"model",               params.model_alias},
-            {"tokens_predicted",    slot.n_decoded},
-            {"tokens_evaluated",    slot.num_prompt_tokens},
-            {"generation_settings", get_formated_generation(slot)},
-            {"prompt",              slot.prompt},
-            {"truncated",           slot.truncated},
-            {"stopped_eos",         slot.stopped_eos},
-            {"stopped_word",        slot.stopped_word},
-            {"stopped_limit",       slot.stopped_limit},
-            {"stopping_word",       slot.stopping_word},
-            {"tokens_cached",       slot.n_past},
-            {"timings",             slot.get_formated_timings()}
-        };
+            send_error(task, "the model is loaded for embeddings only");
+            return;
+        }
 
-        if (slot.sparams.n_probs > 0)
+        llama_embedding_input input;
+        input.task_id      = task.id;
+        input.multitask_id = task.multitask_id;
+        input.tokens       = tokenize(task.data.contains("prompt") ? task.data.at("prompt") : json(""), add_bos_token);
+
+        if (input.tokens.empty())
         {
-            std::vector<completion_token_output> probs = {};
-            if (!slot.params.stream && slot.stopped_word)
+            send_error(task, "empty input");
+        }
+        else if ((int32_t) input.tokens.size() > std::min(params.n_batch, n_ctx))
+        {
+            send_error(task, "the input of " + std::to_string(input.tokens.size()) + " tokens is larger than the batch size " +
+                             std::to_string(std::min(params.n_batch, n_ctx)));
+        }
+        else
+        {
+            embedding_inputs.push_back(std::move(input));
+        }
+    }
+
+    // embedding-only mode: one batch of the waiting inputs per update, without slots nor sampling
+    // state. The batch is filled first-fit by decreasing length: the longest input goes first, the
+    // shorter ones take the room it leaves, and none waits behind inputs shorter than itself.
+    bool update_embeddings()
+    {
+        if (embedding_inputs.empty())
+        {
+            return true;
+        }
+
+        std::stable_sort(embedding_inputs.begin(), embedding_inputs.end(), [](const llama_embedding_input &a, const llama_embedding_input &b) {
+            return a.tokens.size() > b.tokens.size();
+        });
+
+        const int32_t n_batch = std::min(params.n_batch, n_ctx);
+        std::vector<llama_embedding_input> packed;
+        std::vector<llama_embedding_input> waiting;
+        llama_batch_clear(batch);
+        for (llama_embedding_input &input : embedding_inputs)
+        {
+            if ((int32_t) packed.size() < srv_params.n_embedding_seqs && batch.n_tokens + (int32_t) input.tokens.size() <= n_batch)
             {
-                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
-                probs = std::vector<completion_token_output>(slot.generated_token_probs.begin(), slot.generated_token_probs.end() - stop_word_toks.size());
+                const llama_seq_id seq_id = packed.size();
+                for (size_t i = 0; i < input.tokens.size(); i++)
+                {
+                    llama_batch_add(batch, input.tokens[i], i, { seq_id }, i + 1 == input.tokens.size());
+                }
+                packed.push_back(std::move(input));
             }
             else
             {
-                probs = std::vector<completion_token_output>(
-                                    slot.generated_token_probs.begin(),
-                                    slot.generated_token_probs.end());
+                waiting.push_back(std::move(input));
             }
-            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs);
         }
+        embedding_inputs = std::move(waiting);
 
-        if (slot.oaicompat)
+        if (!embedding_inputs.empty())
         {
-            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
-            res.result_json["model"] = slot.oaicompat_model;
+            task_server task;
+            task.type = TASK_TYPE_NEXT_RESPONSE;
+            task.target_id = -1;
+            queue_tasks.post(task);
         }
 
-        queue_results.send(res);
+        const int64_t t_start = ggml_time_us();
+        if (llama_decode(ctx, batch) != 0)
+        {
+            LOG_ERROR("failed to decode the embedding batch", {
+                {"n_seqs",   packed.size()},
+                {"n_tokens", batch.n_tokens},
+            });
+            for (const llama_embedding_input &input : packed)
+            {
+                task_server task;
+                task.id = input.task_id;
+                task.multitask_id = input.multitask_id;
+                send_error(task, "failed to decode the embedding batch");
+            }
+            llama_kv_cache_clear(ctx);
+            return false;
+        }
+
+        int32_t idx = 0;
+        for (size_t k = 0; k < packed.size(); k++)
+        {
+            idx += packed[k].tokens.size();
+            send_embedding(packed[k].task_id, packed[k].multitask_id, k, idx - 1, packed[k].tokens.size());
+        }
+        llama_kv_cache_clear(ctx);
+
+        const int64_t t_us = ggml_time_us() - t_start;
+        metrics.on_embedding_batch(packed.size(), batch.n_tokens, t_us);
+        LOG_INFO("embedding batch", {
+            {"n_seqs",                packed.size()},
+            {"n_tokens",              batch.n_tokens},
+            {"n_waiting",             embedding_inputs.size()},
+            {"t_ms",                  t_us / 1e3},
+            {"seqs_per_second",       1e6 * packed.size() / std::max<int64_t>(t_us, 1)},
+            {"seqs_per_second_total", metrics.embeddings_per_second()},
+        });
+        return true;
     }
 
-    void send_embedding(llama_client_slot &slot)
+    // relevance of the document of a rerank slot, idx is the batch index of the logits of its last token
+    void send_rerank(llama_client_slot &slot, int32_t idx)
     {
         task_result res;
         res.id = slot.task_id;
@@ -1285,30 +2567,68 @@ struct llama_server_context
         res.error = false;
         res.stop = true;
 
-        const int n_embd = llama_n_embd(model);
-        if (!params.embedding)
+        // the probability of the yes token against the no token after the prompt
+        const float *logits = llama_get_logits_ith(ctx, idx);
+        const float score = 1.0f / (1.0f + expf(logits[rerank_no] - logits[rerank_yes]));
+
+        res.result_json = json
         {
-            LOG_WARNING("embedding disabled", {
-                                                  {"params.embedding", params.embedding},
-                                              });
-            res.result_json = json
-            {
-                {"embedding", std::vector<float>(n_embd, 0.0f)},
-            };
+            {"score",            score},
+            {"tokens_evaluated", slot.num_prompt_tokens},
+        };
+        queue_results.send(res);
+    }
+
+    // score every (query, document) pair in its own slot; the sequences are evaluated together in the
+    // batch of the slots, the results come back as a multitask in the order of the documents
+    void request_rerank(int task_id, const std::string &query, const std::vector<std::string> &documents)
+    {
+        if (rerank_yes < 0 || rerank_no < 0)
+        {
+            task_server task;
+            task.id = task_id;
+            send_error(task, "the rerank tokens are not in the vocabulary");
+            return;
         }
-        else
+
+        std::vector<int> subtask_ids(documents.size());
+        for (size_t i = 0; i < documents.size(); i++)
+        {
+            subtask_ids[i] = queue_tasks.get_new_id();
+        }
+        queue_tasks.add_multitask(task_id, subtask_ids);
+
+        for (size_t i = 0; i < documents.size(); i++)
         {
-            const float *data = llama_get_embeddings(ctx);
-            std::vector<float> embedding(data, data + n_embd);
-            res.result_json = json
+            std::string prompt = srv_params.rerank_template;
+            const size_t pos_query = prompt.find("{query}");
+            if (pos_query != std::string::npos)
+            {
+                prompt.replace(pos_query, 7, query);
+            }
+            const size_t pos_document = prompt.find("{document}");
+            if (pos_document != std::string::npos)
+            {
+                prompt.replace(pos_document, 10, documents[i]);
+            }
+
+            task_server task;
+            task.id = subtask_ids[i];
+            task.target_id = 0;
+            task.type = TASK_TYPE_COMPLETION;
+            task.multitask_id = task_id;
+            task.data = json
             {
-                {"embedding", embedding },
+                {"prompt", prompt},
+                {"rerank", true},
             };
+            queue_tasks.post(task);
         }
-        queue_results.send(res);
     }
 
-    void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id)
+    // single-prompt tasks are appended to `batched`, when given, instead of being posted
+    void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id,
+                            std::vector<task_server> *batched = nullptr)
     {
         task_server task;
         task.id = task_id;
@@ -1319,136 +2639,517 @@ struct llama_server_context
         task.type = TASK_TYPE_COMPLETION;
         task.multitask_id = multitask_id;
 
-        // when a completion task's prompt array is not a singleton, we split it into multiple requests
-        // otherwise, it's a single-prompt task, we actually queue it
-        // if there's numbers in the prompt array it will be treated as an array of tokens
-        if (task.data.count("prompt") != 0 && task.data.at("prompt").size() > 1) {
-            bool numbers = false;
-            for (const auto& e : task.data.at("prompt")) {
-                if (e.is_number()) {
-                    numbers = true;
-                    break;
-                }
+        // when a completion task's prompt array is not a singleton, we split it into multiple requests
+        // otherwise, it's a single-prompt task, we actually queue it
+        // if there's numbers in the prompt array it is a single prompt mixing tokens and text,
+        // which tokenize() handles; only an array of strings and token arrays is a list of prompts
+        bool multiprompt = false;
+        if (task.data.count("prompt") != 0 && task.data.at("prompt").is_array() && task.data.at("prompt").size() > 1) {
+            multiprompt = true;
+            for (const auto& e : task.data.at("prompt")) {
+                if (e.is_number()) {
+                    multiprompt = false;
+                    break;
+                }
+            }
+        }
+
+        const int n_choices = embedding ? 1 : json_value(task.data, "n", 1);
+        const int n_beams   = embedding ? 0 : json_value(task.data, "n_beams", 0);
+        if (embedding && !params.embedding) {
+            send_error(task, "the model was loaded without embeddings");
+        } else if (n_choices > 1 && (multiprompt || multitask_id != -1)) {
+            send_error(task, "n > 1 is not supported with multiple prompts");
+        } else if (n_choices > (int) slots.size()) {
+            send_error(task, "n is larger than the number of parallel slots");
+        } else if (n_beams > 1 && n_choices > 1) {
+            send_error(task, "n > 1 is not supported with beam search");
+        } else if (n_beams > (int) slots.size()) {
+            send_error(task, "n_beams is larger than the number of parallel slots");
+        } else if (n_beams > 1 && !json_value(task.data, "grammar", std::string()).empty()) {
+            send_error(task, "grammars are not supported with beam search");
+        } else if (multiprompt) {
+            split_multiprompt_task(task_id, task);
+        } else if (n_choices > 1) {
+            fork_completion_task(task_id, task, n_choices);
+        } else if (batched != nullptr) {
+            batched->push_back(std::move(task));
+        } else {
+            queue_tasks.post(task);
+        }
+    }
+
+    // completion tasks posted together, so that the slots are filled from the whole backlog
+    void request_completions(const std::vector<int> &task_ids, std::vector<json> &datas)
+    {
+        std::vector<task_server> tasks;
+        for (size_t i = 0; i < task_ids.size(); i++)
+        {
+            request_completion(task_ids[i], std::move(datas[i]), false, false, -1, &tasks);
+        }
+        queue_tasks.post(tasks);
+    }
+
+    // for multiple images processing
+    bool ingest_images(llama_client_slot &slot, int n_batch)
+    {
+        int image_idx = 0;
+
+        while (image_idx < (int) slot.images.size())
+        {
+            slot_image &img = slot.images[image_idx];
+
+            // process prefix prompt
+            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
+            {
+                const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
+                llama_batch batch_view = {
+                    n_tokens,
+                    batch.token    + i,
+                    nullptr,
+                    batch.pos      + i,
+                    batch.n_seq_id + i,
+                    batch.seq_id   + i,
+                    batch.logits   + i,
+                    0, 0, 0, // unused
+                };
+                if (llama_decode(ctx, batch_view))
+                {
+                    LOG_TEE("%s : failed to eval\n", __func__);
+                    return false;
+                }
+            }
+
+            // process image with llm
+            for (int i = 0; i < img.image_tokens; i += n_batch)
+            {
+                int n_eval = img.image_tokens - i;
+                if (n_eval > n_batch)
+                {
+                    n_eval = n_batch;
+                }
+
+                const int n_embd = llama_n_embd(model);
+                llama_batch batch_img = { n_eval, nullptr, (img.image_embedding + i * n_embd), nullptr, nullptr, nullptr, nullptr, slot.n_past, 1, 0, };
+                if (llama_decode(ctx, batch_img))
+                {
+                    LOG_TEE("%s : failed to eval image\n", __func__);
+                    return false;
+                }
+                slot.n_past += n_eval;
+            }
+            image_idx++;
+
+            llama_batch_clear(batch);
+
+            // append prefix of next image
+            const auto json_prompt = (image_idx >= (int) slot.images.size()) ?
+                slot.params.input_suffix : // no more images, then process suffix prompt
+                (json)(slot.images[image_idx].prefix_prompt);
+
+            std::vector<llama_token> append_tokens = tokenize(json_prompt, false); // has next image
+            for (int i = 0; i < (int) append_tokens.size(); ++i)
+            {
+                llama_batch_add(batch, append_tokens[i], slot.system_tokens.size() + slot.n_past, { slot.id }, true);
+                slot.n_past += 1;
+            }
+        }
+
+        return true;
+    }
+
+    void request_cancel(int task_id)
+    {
+        task_server task;
+        task.type = TASK_TYPE_CANCEL;
+        task.target_id = task_id;
+        queue_tasks.post(task);
+    }
+
+    // cancel the tasks of a bulk request, with the subtasks of the ones split into a multitask: the
+    // ones still waiting are dropped at once, the others when the main loop reaches their cancel tasks
+    void request_cancel(const std::unordered_set<int> &task_ids)
+    {
+        if (task_ids.empty())
+        {
+            return;
+        }
+        queue_tasks.erase(task_ids);
+        std::vector<task_server> tasks(task_ids.size());
+        size_t i = 0;
+        for (const int task_id : task_ids)
+        {
+            tasks[i].type = TASK_TYPE_CANCEL;
+            tasks[i].target_id = task_id;
+            i++;
+        }
+        queue_tasks.post(tasks);
+    }
+
+    void split_multiprompt_task(int multitask_id, task_server& multiprompt_task)
+    {
+        int prompt_count = multiprompt_task.data.at("prompt").size();
+        if (prompt_count <= 1) {
+            send_error(multiprompt_task, "error while handling multiple prompts");
+            return;
+        }
+
+        // generate all the ID for subtask
+        std::vector<int> subtask_ids(prompt_count);
+        for (int i = 0; i < prompt_count; i++)
+        {
+            subtask_ids[i] = queue_tasks.get_new_id();
+        }
+
+        // queue up the multitask so we can track its subtask progression
+        queue_tasks.add_multitask(multitask_id, subtask_ids);
+
+        // add subtasks
+        for (int i = 0; i < prompt_count; i++)
+        {
+            json subtask_data = multiprompt_task.data;
+            subtask_data["prompt"] = subtask_data["prompt"][i];
+
+            // subtasks inherit everything else (infill mode, embedding mode, etc.)
+            request_completion(subtask_ids[i], subtask_data, multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id);
+        }
+    }
+
+    // n completions of one prompt: a single task evaluates the prompt in one slot, the other
+    // n - 1 slots are reserved with it and get a copy of its KV cells before the first token
+    void fork_completion_task(int multitask_id, task_server& task, int n_choices)
+    {
+        std::vector<int> subtask_ids(n_choices);
+        for (int i = 0; i < n_choices; i++)
+        {
+            subtask_ids[i] = queue_tasks.get_new_id();
+        }
+
+        queue_tasks.add_multitask(multitask_id, subtask_ids);
+
+        task.id = subtask_ids[0];
+        task.multitask_id = multitask_id;
+        task.data.erase("n");
+        task.data["stream"] = false; // the completions are returned together
+        task.data["fork_task_ids"] = std::vector<int>(subtask_ids.begin() + 1, subtask_ids.end());
+        queue_tasks.post(task);
+    }
+
+    // fail the completions still waiting for a slot whose prompt will not be evaluated
+    void fork_cancel(llama_client_slot &slot)
+    {
+        for (const auto &[slot_id, task_id] : slot.fork_slots)
+        {
+            llama_client_slot &child = slots[slot_id];
+            if (child.command == FORK && child.task_id == task_id)
+            {
+                child.command = NONE;
+                if (child.beam_leader >= 0)
+                {
+                    continue;
+                }
+
+                task_server task;
+                task.id = child.task_id;
+                task.multitask_id = child.multitask_id;
+                send_error(task, "the shared prompt was not evaluated");
+            }
+        }
+        slot.fork_slots.clear();
+    }
+
+    // share the evaluated prompt of a slot with its waiting completions, idx is the batch index of its logits
+    void fork_slot(llama_client_slot &slot, int32_t idx)
+    {
+        const float *logits = llama_get_logits_ith(ctx, idx);
+        fork_rows.push_back({ slot.i_batch, std::vector<float>(logits, logits + llama_n_vocab(model)) });
+
+        for (const auto &[slot_id, task_id] : slot.fork_slots)
+        {
+            llama_client_slot &child = slots[slot_id];
+            if (child.command != FORK || child.task_id != task_id)
+            {
+                continue; // cancelled
+            }
+
+            llama_kv_cache_seq_rm(ctx, child.id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, slot.id, child.id, -1, -1);
+
+            child.system_key    = slot.system_key;
+            child.system_tokens = slot.system_tokens;
+            child.cache_tokens  = slot.cache_tokens;
+            child.n_past        = slot.n_past;
+            child.n_past_se     = slot.n_past_se;
+            child.ga_i          = slot.ga_i;
+            child.truncated     = slot.truncated;
+
+            child.num_prompt_tokens           = slot.num_prompt_tokens;
+            child.num_prompt_tokens_processed = slot.num_prompt_tokens_processed;
+            child.t_start_process_prompt      = slot.t_start_process_prompt;
+            child.t_start_genereration        = 0;
+
+            llama_sampling_cp(slot.ctx_sampling, child.ctx_sampling);
+
+            child.state     = PROCESSING;
+            child.command   = NONE;
+            child.n_decoded = 0;
+            child.i_batch   = slot.i_batch;
+
+            LOG_VERBOSE("slot forked", {{"slot_id", slot.id}, {"child_slot_id", child.id}, {"task_id", child.task_id}});
+        }
+        slot.fork_slots.clear();
+    }
+
+    const fork_logits *find_fork_logits(int32_t i_batch) const
+    {
+        for (const fork_logits &row : fork_rows)
+        {
+            if (row.i_batch == i_batch)
+            {
+                return &row;
             }
+        }
+        return nullptr;
+    }
 
-            // NOTE: split_multiprompt_task() does not handle a mix of strings and numbers,
-            // it will completely stall the server. I don't know where the bug for this is.
-            //
-            // if there are numbers, it needs to be treated like a single prompt,
-            // queue_tasks handles a mix of strings and numbers just fine.
-            if (numbers) {
-                queue_tasks.post(task);
-            } else {
-                split_multiprompt_task(task_id, task);
+    // the running beams of a search, in beam_slots
+    void beam_group(const llama_client_slot &leader)
+    {
+        beam_slots.clear();
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.beam_leader == leader.id && slot.state == PROCESSING && slot.command != RELEASE)
+            {
+                beam_slots.push_back(&slot);
             }
-        } else {
-            queue_tasks.post(task);
         }
     }
 
-    // for multiple images processing
-    bool ingest_images(llama_client_slot &slot, int n_batch)
+    // the candidates of a beam from its logits, the search advances once every beam has them
+    void beam_collect(llama_client_slot &slot, int32_t idx)
     {
-        int image_idx = 0;
-
-        while (image_idx < (int) slot.images.size())
+        llama_client_slot &leader = slots[slot.beam_leader];
+        if (slot.command == RELEASE || leader.command == RELEASE)
         {
-            slot_image &img = slot.images[image_idx];
+            return;
+        }
 
-            // process prefix prompt
-            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
+        // the logit bias (ignore_eos included) and the repetition penalties over the tokens of this beam
+        // apply as in llama_sampling_sample, before the candidates are ranked
+        const llama_sampling_params &sp = leader.sparams;
+        const int32_t n_vocab = llama_n_vocab(model);
+        const size_t n_penalty = std::min(slot.cache_tokens.size(), (size_t) std::max(sp.penalty_last_n, 0));
+        const bool has_penalty = n_penalty > 0 && (sp.penalty_repeat != 1.0f || sp.penalty_freq != 0.0f || sp.penalty_present != 0.0f);
+        slot.beam_penalty_window.clear();
+        if (has_penalty)
+        {
+            slot.beam_penalty_window.assign(slot.cache_tokens.end() - n_penalty, slot.cache_tokens.end());
+            std::sort(slot.beam_penalty_window.begin(), slot.beam_penalty_window.end());
+        }
+        const llama_token nl = llama_token_nl(model);
+        const auto adjust = [&](std::vector<float> &logits) {
+            for (const auto &bias : sp.logit_bias)
             {
-                const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
-                llama_batch batch_view = {
-                    n_tokens,
-                    batch.token    + i,
-                    nullptr,
-                    batch.pos      + i,
-                    batch.n_seq_id + i,
-                    batch.seq_id   + i,
-                    batch.logits   + i,
-                    0, 0, 0, // unused
-                };
-                if (llama_decode(ctx, batch_view))
+                if (bias.first >= 0 && bias.first < n_vocab)
                 {
-                    LOG_TEE("%s : failed to eval\n", __func__);
-                    return false;
+                    logits[bias.first] += bias.second;
                 }
             }
-
-            // process image with llm
-            for (int i = 0; i < img.image_tokens; i += n_batch)
+            const std::vector<llama_token> &window = slot.beam_penalty_window;
+            for (auto it = window.begin(); it != window.end(); )
             {
-                int n_eval = img.image_tokens - i;
-                if (n_eval > n_batch)
+                const auto end = std::upper_bound(it, window.end(), *it);
+                const llama_token tok = *it;
+                const int32_t count = end - it;
+                it = end;
+                if (tok < 0 || tok >= n_vocab || (tok == nl && !sp.penalize_nl))
                 {
-                    n_eval = n_batch;
+                    continue;
                 }
+                float &logit = logits[tok];
+                logit = logit <= 0 ? logit * sp.penalty_repeat : logit / sp.penalty_repeat;
+                logit -= float(count) * sp.penalty_freq + sp.penalty_present;
+            }
+        };
 
-                const int n_embd = llama_n_embd(model);
-                llama_batch batch_img = { n_eval, nullptr, (img.image_embedding + i * n_embd), nullptr, nullptr, nullptr, nullptr, slot.n_past, 1, 0, };
-                if (llama_decode(ctx, batch_img))
-                {
-                    LOG_TEE("%s : failed to eval image\n", __func__);
-                    return false;
-                }
-                slot.n_past += n_eval;
+        // with as many extra candidates as there are end of generation tokens, the beams can always be refilled
+        const size_t n_candidates = leader.n_beams + eog_tokens.size();
+        slot.logprobs.top_n(llama_get_logits_ith(ctx, idx), n_vocab, n_candidates, slot.beam_candidates, adjust);
+        slot.beam_ready = true;
+
+        beam_group(leader);
+        for (const llama_client_slot *beam : beam_slots)
+        {
+            if (!beam->beam_ready)
+            {
+                return;
             }
-            image_idx++;
+        }
+        beam_step(leader);
+    }
 
-            llama_batch_clear(batch);
+    void beam_step(llama_client_slot &leader)
+    {
+        struct candidate
+        {
+            llama_client_slot *parent;
+            llama_token tok;
+            float score;
+            llama_client_slot *target;
+        };
 
-            // append prefix of next image
-            const auto json_prompt = (image_idx >= (int) slot.images.size()) ?
-                slot.params.input_suffix : // no more images, then process suffix prompt
-                (json)(slot.images[image_idx].prefix_prompt);
+        if (leader.n_decoded == 0)
+        {
+            leader.t_start_genereration = ggml_time_us();
+            leader.t_prompt_processing = (leader.t_start_genereration - leader.t_start_process_prompt) / 1e3;
+            metrics.on_prompt_eval(leader);
+        }
 
-            std::vector<llama_token> append_tokens = tokenize(json_prompt, false); // has next image
-            for (int i = 0; i < (int) append_tokens.size(); ++i)
+        // the beams are copies of the first one until the first token
+        std::vector<candidate> candidates;
+        for (llama_client_slot *beam : beam_slots)
+        {
+            beam->beam_ready = false;
+            if (leader.n_decoded == 0 && beam != &leader)
             {
-                llama_batch_add(batch, append_tokens[i], system_tokens.size() + slot.n_past, { slot.id }, true);
-                slot.n_past += 1;
+                continue;
+            }
+            for (const auto &p : beam->beam_candidates)
+            {
+                candidates.push_back({ beam, p.tok, beam->beam_score + logf(p.prob), nullptr });
             }
         }
+        std::sort(candidates.begin(), candidates.end(), [](const candidate &a, const candidate &b) {
+            return a.score > b.score;
+        });
 
-        return true;
-    }
+        // the best candidates continue the beams, the ending ones ranked above them are finished
+        const int32_t n_decoded = leader.n_decoded + 1;
+        std::vector<candidate> next;
+        for (const candidate &c : candidates)
+        {
+            if (next.size() == beam_slots.size())
+            {
+                break;
+            }
+            if (is_eog_token(c.tok))
+            {
+                const llama_client_slot &parent = *c.parent;
+                leader.beam_finished.push_back({
+                    std::vector<llama_token>(parent.cache_tokens.begin() + parent.num_prompt_tokens, parent.cache_tokens.end()),
+                    c.score / n_decoded,
+                    true,
+                });
+                continue;
+            }
+            next.push_back(c);
+        }
 
-    void request_cancel(int task_id)
-    {
-        task_server task;
-        task.type = TASK_TYPE_CANCEL;
-        task.target_id = task_id;
-        queue_tasks.post(task);
+        // a beam keeps its slot for its best continuation, the others take the slots of the dropped beams
+        for (candidate &c : next)
+        {
+            if (!c.parent->beam_ready)
+            {
+                c.parent->beam_ready = true; // reused as the kept mark
+                c.target = c.parent;
+            }
+        }
+        std::vector<llama_client_slot *> dropped;
+        for (llama_client_slot *beam : beam_slots)
+        {
+            if (!beam->beam_ready)
+            {
+                dropped.push_back(beam);
+            }
+            beam->beam_ready = false;
+        }
+        for (candidate &c : next)
+        {
+            if (c.target != nullptr)
+            {
+                continue;
+            }
+            c.target = dropped.back();
+            dropped.pop_back();
+
+            llama_kv_cache_seq_rm(ctx, c.target->id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, c.parent->id, c.target->id, -1, -1);
+            c.target->cache_tokens = c.parent->cache_tokens;
+            c.target->n_past       = c.parent->n_past;
+        }
+        for (const candidate &c : next)
+        {
+            c.target->sampled    = c.tok;
+            c.target->beam_score = c.score;
+            c.target->n_decoded  = n_decoded;
+            c.target->cache_tokens.push_back(c.tok);
+        }
+        leader.n_decoded = n_decoded;
+
+        if (next.size() < beam_slots.size() || (int32_t) leader.beam_finished.size() >= leader.n_beams || !leader.has_budget(params))
+        {
+            beam_finish(leader);
+        }
     }
 
-    void split_multiprompt_task(int multitask_id, task_server& multiprompt_task)
+    // end the search with its best hypothesis, among the finished and the running beams
+    void beam_finish(llama_client_slot &leader)
     {
-        int prompt_count = multiprompt_task.data.at("prompt").size();
-        if (prompt_count <= 1) {
-            send_error(multiprompt_task, "error while handling multiple prompts");
+        if (leader.command == RELEASE)
+        {
             return;
         }
 
-        // generate all the ID for subtask
-        std::vector<int> subtask_ids(prompt_count);
-        for (int i = 0; i < prompt_count; i++)
+        beam_group(leader);
+        for (const llama_client_slot *beam : beam_slots)
         {
-            subtask_ids[i] = queue_tasks.get_new_id();
+            if (beam->n_decoded > 0)
+            {
+                leader.beam_finished.push_back({
+                    std::vector<llama_token>(beam->cache_tokens.begin() + beam->num_prompt_tokens, beam->cache_tokens.end()),
+                    beam->beam_score / beam->n_decoded,
+                    false,
+                });
+            }
         }
 
-        // queue up the multitask so we can track its subtask progression
-        queue_tasks.add_multitask(multitask_id, subtask_ids);
+        const beam_hypothesis *best = nullptr;
+        for (const beam_hypothesis &hyp : leader.beam_finished)
+        {
+            if (best == nullptr || hyp.score > best->score)
+            {
+                best = &hyp;
+            }
+        }
 
-        // add subtasks
-        for (int i = 0; i < prompt_count; i++)
+        leader.generated_text.clear();
+        leader.n_decoded = 0;
+        if (best != nullptr)
         {
-            json subtask_data = multiprompt_task.data;
-            subtask_data["prompt"] = subtask_data["prompt"][i];
+            leader.generated_text = tokens_to_str(vocab_pieces, best->tokens.cbegin(), best->tokens.cend());
+            leader.n_decoded      = best->tokens.size();
+            leader.stopped_eos    = best->eog;
+        }
 
-            // subtasks inherit everything else (infill mode, embedding mode, etc.)
-            request_completion(subtask_ids[i], subtask_data, multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id);
+        // the stop strings cut the chosen text, they do not steer the search
+        leader.stop_matcher.feed(leader.generated_text.data(), leader.generated_text.size());
+        if (leader.stop_matcher.match_pos != std::string::npos)
+        {
+            leader.generated_text.resize(leader.stop_matcher.match_pos);
+            leader.stopped_word  = true;
+            leader.stopped_eos   = false;
+            leader.stopping_word = leader.params.antiprompt[leader.stop_matcher.match_idx];
         }
+        leader.stopped_limit = !leader.stopped_eos && !leader.stopped_word;
+
+        for (llama_client_slot *beam : beam_slots)
+        {
+            beam->release();
+        }
+        leader.release();
+        leader.print_timings();
+        send_final_response(leader);
+        metrics.on_prediction(leader);
     }
 
     void process_single_task(task_server& task)
@@ -1456,36 +3157,91 @@ struct llama_server_context
         switch (task.type)
         {
             case TASK_TYPE_COMPLETION: {
-                llama_client_slot *slot = get_slot(json_value(task.data, "slot_id", -1));
-                if (slot == nullptr)
+                if (srv_params.embedding_only)
                 {
-                    // if no slot is available, we defer this task for processing later
-                    LOG_VERBOSE("no slot is available", {{"task_id", task.id}});
-                    queue_tasks.defer(task);
+                    queue_embedding(task);
                     break;
                 }
 
+                std::string system_key;
                 if (task.data.contains("system_prompt"))
                 {
-                    if (!all_slots_are_idle) {
-                        send_error(task, "system prompt can only be updated when all slots are idle");
+                    if (srv_params.n_system_prompts <= 0)
+                    {
+                        send_error(task, "system prompts are disabled");
+                        break;
+                    }
+                    if (!process_system_prompt_data(task.data["system_prompt"], system_key))
+                    {
+                        // every cached system prompt is about to be used by a slot
+                        LOG_VERBOSE("no system prompt sequence is available", {{"task_id", task.id}});
+                        queue_tasks.defer(task);
+                        break;
+                    }
+                }
+
+                // the completions sharing the prompt and the beams start together, in as many free slots
+                const std::vector<int> fork_task_ids = json_value(task.data, "fork_task_ids", std::vector<int>());
+                const int32_t n_beams = json_value(task.data, "n_beams", 0);
+                const size_t n_slots = std::max(fork_task_ids.size() + 1, (size_t) std::max(n_beams, 1));
+                if (n_slots > 1)
+                {
+                    size_t n_available = 0;
+                    for (const llama_client_slot &other : slots)
+                    {
+                        n_available += other.available();
+                    }
+                    if (n_available < n_slots)
+                    {
+                        LOG_VERBOSE("not enough slots are available", {{"task_id", task.id}, {"n_slots", n_slots}});
+                        queue_tasks.defer(task);
                         break;
                     }
-                    process_system_prompt_data(task.data["system_prompt"]);
+                }
+
+                llama_client_slot *slot = get_slot(json_value(task.data, "slot_id", -1));
+                const int32_t priority = json_value(task.data, "priority", 0);
+
+                // swapped out slots resume before new tasks that do not outrank them
+                if (slot != nullptr && !swapped_slots.empty() && swapped_max_priority() >= priority)
+                {
+                    slot = nullptr;
+                }
 
-                    // reset cache_tokens for all slots
-                    for (llama_client_slot &slot : slots)
+                // all slots are busy: make room by swapping out a lower priority one
+                if (slot == nullptr && swapped_slots.empty())
+                {
+                    llama_client_slot *victim = nullptr;
+                    for (llama_client_slot &other : slots)
                     {
-                        slot.cache_tokens.clear();
-                        slot.n_past    = 0;
-                        slot.n_past_se = 0;
+                        if ((kv_can_preempt(other) || (other.preempted && other.command != RELEASE)) && other.params.priority < priority &&
+                            (victim == nullptr || other.params.priority < victim->params.priority))
+                        {
+                            victim = &other;
+                        }
+                    }
+                    if (victim != nullptr)
+                    {
+                        swap_out_slot(*victim);
+                        slot = victim;
                     }
                 }
 
+                if (slot == nullptr)
+                {
+                    // if no slot is available, we defer this task for processing later
+                    LOG_VERBOSE("no slot is available", {{"task_id", task.id}});
+                    queue_tasks.defer(task);
+                    break;
+                }
+
                 slot->reset();
 
+                slot->system_key = system_key;
+
                 slot->infill       = task.infill_mode;
                 slot->embedding    = task.embedding_mode;
+                slot->rerank       = json_value(task.data, "rerank", false);
                 slot->task_id      = task.id;
                 slot->multitask_id = task.multitask_id;
 
@@ -1493,18 +3249,107 @@ struct llama_server_context
                 {
                     // send error result
                     send_error(task, "internal_error");
+                    for (const int fork_task_id : fork_task_ids)
+                    {
+                        task_server fork_task = task;
+                        fork_task.id = fork_task_id;
+                        send_error(fork_task, "internal_error");
+                    }
                     break;
                 }
+
+                // distinct seeds, otherwise the completions would all be the same
+                const uint32_t seed = slot->params.seed == LLAMA_DEFAULT_SEED ? std::random_device{}() : slot->params.seed;
+                for (size_t k = 0; k < fork_task_ids.size(); k++)
+                {
+                    llama_client_slot *child = get_slot(-1);
+                    child->reset();
+
+                    child->infill       = task.infill_mode;
+                    child->embedding    = task.embedding_mode;
+                    child->task_id      = fork_task_ids[k];
+                    child->multitask_id = task.multitask_id;
+
+                    json child_data = task.data;
+                    child_data["seed"] = seed + k + 1;
+                    if (!launch_slot_with_data(child, child_data))
+                    {
+                        task_server fork_task = task;
+                        fork_task.id = fork_task_ids[k];
+                        send_error(fork_task, "internal_error");
+                        continue;
+                    }
+
+                    child->command = FORK;
+                    slot->fork_slots.push_back({ child->id, child->task_id });
+                }
+
+                // the beams are forked like the completions above, but share the task of the first one
+                if (n_beams > 1)
+                {
+                    slot->beam_leader = slot->id;
+                    slot->n_beams     = n_beams;
+                    for (int32_t k = 1; k < n_beams; k++)
+                    {
+                        llama_client_slot *child = get_slot(-1);
+                        child->reset();
+
+                        child->infill       = task.infill_mode;
+                        child->embedding    = task.embedding_mode;
+                        child->task_id      = task.id;
+                        child->multitask_id = task.multitask_id;
+                        if (!launch_slot_with_data(child, task.data))
+                        {
+                            continue; // a narrower search
+                        }
+
+                        child->command     = FORK;
+                        child->beam_leader = slot->id;
+                        slot->fork_slots.push_back({ child->id, child->task_id });
+                    }
+                }
             } break;
             case TASK_TYPE_CANCEL: { // release slot linked with the task id
+                // the target is a task, or a multitask whose subtasks are all cancelled: the n completions
+                // forked from one prompt, or the prompts of a multiprompt request
+                const int target_id = task.target_id;
+                const auto cancelled = [target_id](int task_id, int multitask_id) {
+                    return task_id == target_id || multitask_id == target_id;
+                };
                 for (auto & slot : slots)
                 {
-                    if (slot.task_id == task.target_id)
+                    // all the beams of a beam search have the task id
+                    if (cancelled(slot.task_id, slot.multitask_id))
                     {
+                        if (slot.command == FORK)
+                        {
+                            slot.command = NONE;
+                            queue_tasks.notify_slot_changed();
+                        }
                         slot.release();
-                        break;
                     }
                 }
+                for (auto it = swapped_slots.begin(); it != swapped_slots.end(); )
+                {
+                    if (cancelled(it->task_id, it->multitask_id))
+                    {
+                        it->reset();
+                        if (it->ctx_sampling != nullptr)
+                        {
+                            llama_sampling_free(it->ctx_sampling);
+                        }
+                        it = swapped_slots.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+                // a task deferred for want of a slot, or an input waiting for an embedding batch
+                queue_tasks.erase({ target_id });
+                embedding_inputs.erase(std::remove_if(embedding_inputs.begin(), embedding_inputs.end(),
+                                                      [&](const llama_embedding_input &input) { return cancelled(input.task_id, input.multitask_id); }),
+                                       embedding_inputs.end());
             } break;
             case TASK_TYPE_NEXT_RESPONSE: {
                 // do nothing
@@ -1520,29 +3365,43 @@ struct llama_server_context
         result.stop = true;
         result.error = false;
 
-        // collect json results into one json result
+        // collect json results into one json result, in the order of the subtasks;
+        // the multitask failed when any of them did, with the error of the first one
+        std::sort(multitask.results.begin(), multitask.results.end(), [](const task_result &a, const task_result &b) {
+            return a.id < b.id;
+        });
         std::vector<json> result_jsons;
+        std::string error;
         for (auto& subres : multitask.results)
         {
             result_jsons.push_back(subres.result_json);
-            result.error = result.error && subres.error;
+            if (subres.error && !result.error)
+            {
+                result.error = true;
+                error = subres.result_json.value("content", "subtask failed");
+            }
         }
         result.result_json = json{ { "results", result_jsons } };
+        if (result.error)
+        {
+            result.result_json["content"] = error;
+        }
         queue_results.send(result);
     }
 
     bool update_slots() {
-        if (system_need_update)
+        if (srv_params.embedding_only)
         {
-            LOG_INFO("updating system prompt", {});
-            update_system_prompt();
+            return update_embeddings();
         }
 
+        update_system_prompts();
+
         llama_batch_clear(batch);
 
-        if (all_slots_are_idle)
+        if (all_slots_are_idle && swapped_slots.empty())
         {
-            if (system_prompt.empty() && clean_kv_cache)
+            if (system_prompts.empty() && clean_kv_cache)
             {
                 LOG_INFO("all slots are idle and system prompt is empty, clear the KV cache", {});
                 kv_cache_clear();
@@ -1560,8 +3419,17 @@ struct llama_server_context
         {
             if (slot.ga_n == 1)
             {
-                if (slot.is_processing() && system_tokens.size() + slot.cache_tokens.size() >= (size_t) slot.n_ctx)
+                if (slot.is_processing() && slot.system_tokens.size() + slot.cache_tokens.size() >= (size_t) slot.n_ctx)
                 {
+                    if (slot.beam_leader >= 0)
+                    {
+                        if (slot.state == PROCESSING)
+                        {
+                            beam_finish(slots[slot.beam_leader]);
+                        }
+                        continue;
+                    }
+
                     // START LOCALAI changes
                     // Temporary disable context-shifting as it can lead to infinite loops (issue: https://github.com/ggerganov/llama.cpp/issues/3969)
                     // See: https://github.com/mudler/LocalAI/issues/1333
@@ -1580,6 +3448,42 @@ struct llama_server_context
             }
         }
 
+        if (srv_params.elastic_ctx)
+        {
+            kv_sync();
+
+            for (llama_client_slot &slot : slots)
+            {
+                if (slot.preempt_requested && kv_can_preempt(slot))
+                {
+                    kv_preempt_slot(slot);
+                }
+                slot.preempt_requested = false;
+            }
+
+            // the running sequences outgrew their reservations: preempt until the rest fits,
+            // a sequence left alone in the pool is ended as context-exhausted instead
+            while (kv.n_blocks_free() < 0)
+            {
+                int32_t n_running = 0;
+                for (llama_client_slot &slot : slots)
+                {
+                    n_running += slot.state == PROCESSING && slot.command != RELEASE && !slot.preempted;
+                }
+                if (n_running <= 1)
+                {
+                    break;
+                }
+
+                llama_client_slot *victim = kv_preemption_victim(INT32_MAX);
+                if (victim == nullptr)
+                {
+                    break;
+                }
+                kv_preempt_slot(*victim);
+            }
+        }
+
         // decode any currently ongoing sequences
         LOG_VERBOSE("decoding ongoing sequences", {});
         for (auto & slot : slots)
@@ -1591,12 +3495,24 @@ struct llama_server_context
                 slot.command = NONE;
                 slot.t_last_used = ggml_time_us();
 
+                fork_cancel(slot);
+
+                if (slot.preempted)
+                {
+                    // cancelled while waiting to resume, its cells are already gone
+                    llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                    slot.preempted = false;
+                    slot.system_tokens.clear();
+                    slot.cache_tokens.clear();
+                    slot.n_past = 0;
+                }
+
                 LOG_INFO("slot released", {
                     {"slot_id",         slot.id},
                     {"task_id",         slot.task_id},
                     {"n_ctx",           n_ctx},
                     {"n_past",          slot.n_past},
-                    {"n_system_tokens", system_tokens.size()},
+                    {"n_system_tokens", slot.system_tokens.size()},
                     {"n_cache_tokens",  slot.cache_tokens.size()},
                     {"truncated",       slot.truncated}
                 });
@@ -1605,7 +3521,7 @@ struct llama_server_context
                 continue;
             }
 
-            if (slot.state == IDLE)
+            if (slot.state == IDLE || slot.preempted)
             {
                 continue;
             }
@@ -1614,18 +3530,20 @@ struct llama_server_context
 
             const int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
-            // TODO: we always have to take into account the "system_tokens"
-            //       this is not great and needs to be improved somehow
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id }, true);
+            // positions start after the system prompt shared into the sequence
+            llama_batch_add(batch, slot.sampled, slot.system_tokens.size() + slot_npast, { slot.id }, true);
             slot.n_past += 1;
         }
 
-        // process in chunks of params.n_batch
-        int32_t n_batch = params.n_batch;
+        // process in chunks of n_batch, bounded by what the KV cache accepted so far
+        int32_t n_batch = batch_controller.get_n_batch(n_ctx - llama_get_kv_cache_used_cells(ctx));
 
         // assign workload to the slots
         if (params.cont_batching || batch.n_tokens == 0)
         {
+            swap_in_slots();
+            kv_resume_preempted();
+
             for (auto & slot : slots)
             {
                 const bool has_prompt = slot.prompt.is_array() || (slot.prompt.is_string() && !slot.prompt.get<std::string>().empty()) || !slot.images.empty();
@@ -1634,6 +3552,7 @@ struct llama_server_context
                 // note: infill mode allows empty prompt
                 if (slot.state == IDLE && slot.command == LOAD_PROMPT && !has_prompt && !slot.infill)
                 {
+                    fork_cancel(slot);
                     slot.release();
                     slot.print_timings();
                     send_final_response(slot);
@@ -1649,6 +3568,8 @@ struct llama_server_context
                     slot.t_start_process_prompt = ggml_time_us();
                     slot.t_start_genereration = 0;
 
+                    system_prompt_attach(slot);
+
                     if (slot.infill)
                     {
                         bool suff_rm_leading_spc = true;
@@ -1674,7 +3595,7 @@ struct llama_server_context
                     }
                     else
                     {
-                        prompt_tokens = tokenize(slot.prompt, system_prompt.empty() && add_bos_token);  // add BOS if there isn't system prompt
+                        prompt_tokens = tokenize(slot.prompt, slot.system_tokens.empty() && add_bos_token);  // add BOS if there isn't system prompt
                     }
 
                     slot.num_prompt_tokens = prompt_tokens.size();
@@ -1699,7 +3620,7 @@ struct llama_server_context
                             {"n_ctx",  slot.n_ctx},
                             {"n_keep", slot.params.n_keep},
                             {"n_left", n_left},
-                            {"new_tokens", tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend())},
+                            {"new_tokens", tokens_to_str(vocab_pieces, new_tokens.cbegin(), new_tokens.cend())},
                         });
                         slot.truncated = true;
                         prompt_tokens = new_tokens;
@@ -1708,9 +3629,41 @@ struct llama_server_context
                         GGML_ASSERT(slot.num_prompt_tokens < slot.n_ctx);
                     }
 
-                    if (!slot.params.cache_prompt)
+                    if (srv_params.elastic_ctx && !kv_admit(slot, prompt_tokens))
+                    {
+                        // retried on the next update, once running sequences have released cells
+                        slot.state = IDLE;
+                        slot.command = LOAD_PROMPT;
+                        continue;
+                    }
+
+                    // a pooled output needs the whole prompt in one ubatch, which the batch is split
+                    // into at multiples of n_batch: a prompt that does not fit in what is left of the
+                    // current one waits for the next update
+                    if ((slot.embedding || slot.rerank) && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE)
+                    {
+                        if (slot.num_prompt_tokens > params.n_batch)
+                        {
+                            task_server task;
+                            task.id = slot.task_id;
+                            task.multitask_id = slot.multitask_id;
+                            send_error(task, "the input of " + std::to_string(slot.num_prompt_tokens) +
+                                             " tokens is larger than the batch size " + std::to_string(params.n_batch));
+                            slot.release();
+                            slot.i_batch = -1;
+                            continue;
+                        }
+                        if (batch.n_tokens % n_batch + slot.num_prompt_tokens > n_batch)
+                        {
+                            slot.state = IDLE;
+                            slot.command = LOAD_PROMPT;
+                            continue;
+                        }
+                    }
+
+                    if (!slot.params.cache_prompt || slot.embedding)
                     {
-                        llama_sampling_reset(slot.ctx_sampling);
+                        sampling_reset(slot);
 
                         slot.n_past = 0;
                         slot.n_past_se = 0;
@@ -1779,7 +3732,7 @@ struct llama_server_context
                         }
                     }
 
-                    int p0 = (int) system_tokens.size() + slot.n_past;
+                    int p0 = (int) slot.system_tokens.size() + slot.n_past;
                     LOG_INFO("kv cache rm [p0, end)", {
                         { "slot_id", slot.id },
                         { "task_id", slot.task_id },
@@ -1789,8 +3742,8 @@ struct llama_server_context
 
                     LOG_VERBOSE("prompt ingested", {
                                                     {"n_past",  slot.n_past},
-                                                    {"cached",  tokens_to_str(ctx, slot.cache_tokens.cbegin(), slot.cache_tokens.cbegin() + slot.n_past)},
-                                                    {"to_eval", tokens_to_str(ctx, slot.cache_tokens.cbegin() + slot.n_past, slot.cache_tokens.cend())},
+                                                    {"cached",  tokens_to_str(vocab_pieces, slot.cache_tokens.cbegin(), slot.cache_tokens.cbegin() + slot.n_past)},
+                                                    {"to_eval", tokens_to_str(vocab_pieces, slot.cache_tokens.cbegin() + slot.n_past, slot.cache_tokens.cend())},
                                                 });
 
                     const bool has_images = process_images(slot);
@@ -1814,7 +3767,7 @@ struct llama_server_context
                                 ga_i += ga_w/ga_n;
                             }
                         }
-                        llama_batch_add(batch, prefix_tokens[slot.n_past], system_tokens.size() + slot_npast, {slot.id }, false);
+                        llama_batch_add(batch, prefix_tokens[slot.n_past], slot.system_tokens.size() + slot_npast, {slot.id }, false);
                         slot_npast++;
                     }
 
@@ -1894,6 +3847,8 @@ struct llama_server_context
                 0, 0, 0, // unused
             };
 
+            const bool timed = batch_controller.should_time(n_batch, n_tokens);
+            const int64_t t_decode_start = ggml_time_us();
             const int ret = llama_decode(ctx, batch_view);
 
             if (ret != 0)
@@ -1905,14 +3860,53 @@ struct llama_server_context
                     return false;
                 }
 
-                LOG_TEE("%s : failed to find free space in the KV cache, retrying with smaller n_batch = %d\n", __func__, n_batch / 2);
-
-                // retry with half the batch size to try to find a free slot in the KV cache
-                n_batch /= 2;
+                // retry with a smaller batch to try to find a free slot in the KV cache,
+                // the controller keeps the limit for the next calls
+                n_batch = batch_controller.on_decode_failure(n_batch);
                 i -= n_batch;
                 continue;
             }
 
+            if (timed)
+            {
+                llama_synchronize(ctx);
+            }
+            batch_controller.on_decode_success(n_batch, n_tokens, timed ? ggml_time_us() - t_decode_start : -1);
+
+            // the evaluated prompts shared by several completions are forked into their slots
+            fork_rows.clear();
+            for (auto & slot : slots)
+            {
+                if (!slot.fork_slots.empty() && slot.i_batch >= (int) i && slot.i_batch < (int) (i + n_tokens))
+                {
+                    fork_slot(slot, slot.i_batch - i);
+                }
+            }
+
+            // the slots on the fused sampling path are sampled concurrently, their results
+            // are then sent below in slot order together with the other slots
+            sampling_slots.clear();
+            sampling_logits.clear();
+            for (auto & slot : slots)
+            {
+                if (sampling_pool.size() > 0 && slot.i_batch >= (int) i && slot.i_batch < (int) (i + n_tokens) &&
+                    !slot.embedding && !slot.rerank && slot.beam_leader < 0 && llama_fused_sampler::supported(slot.ctx_sampling) && find_fork_logits(slot.i_batch) == nullptr)
+                {
+                    // the logits are fetched here, llama_get_logits_ith synchronizes the context
+                    sampling_slots.push_back(&slot);
+                    sampling_logits.push_back(llama_get_logits_ith(ctx, slot.i_batch - i));
+                }
+            }
+            if (sampling_slots.size() > 1)
+            {
+                const std::function<void(size_t)> job = [this, i](size_t k) {
+                    llama_client_slot &slot = *sampling_slots[k];
+                    slot.has_next_async = sample_slot(slot, slot.i_batch - i, sampling_logits[k]);
+                    slot.sampled_async  = true;
+                };
+                sampling_pool.run(sampling_slots.size(), job);
+            }
+
             for (auto & slot : slots)
             {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens))
@@ -1923,41 +3917,47 @@ struct llama_server_context
                 // prompt evaluated for embedding
                 if (slot.embedding)
                 {
-                    send_embedding(slot);
+                    send_embedding(slot, slot.i_batch - i);
                     slot.release();
                     slot.i_batch = -1;
                     continue;
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                if (slot.rerank)
+                {
+                    send_rerank(slot, slot.i_batch - i);
+                    slot.release();
+                    slot.i_batch = -1;
+                    continue;
+                }
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+                if (slot.beam_leader >= 0)
+                {
+                    beam_collect(slot, slot.i_batch - i);
+                    slot.i_batch = -1;
+                    continue;
+                }
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1)
+                if (const fork_logits *row = find_fork_logits(slot.i_batch))
                 {
-                    slot.t_start_genereration = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+                    std::copy(row->logits.begin(), row->logits.end(), llama_get_logits_ith(ctx, slot.i_batch - i));
                 }
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+                const bool has_next = slot.sampled_async ? slot.has_next_async : sample_slot(slot, slot.i_batch - i);
+                slot.sampled_async = false;
 
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0)
+                if (slot.n_decoded == 1)
                 {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
+                    metrics.on_prompt_eval(slot);
                 }
 
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+                if (slot.send_pending)
                 {
-                    result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                    send_partial_response(slot, slot.token_output);
+                    slot.send_pending = false;
                 }
 
-                if (!process_token(result, slot))
+                if (!has_next)
                 {
                     slot.release();
                     slot.print_timings();
@@ -1973,6 +3973,81 @@ struct llama_server_context
         return true;
     }
 
+    // sample the next token of a slot and process it, the partial response is left to the caller;
+    // on the fused path this only touches the slot and can run on a worker thread
+    bool sample_slot(llama_client_slot &slot, int32_t idx, const float *logits = nullptr) {
+        completion_token_output &result = slot.token_output;
+        result.probs.clear();
+        result.text_to_send.clear();
+
+        // mask the logits through the grammar trie and sample with the grammar detached,
+        // unless most of the vocabulary was found acceptable recently
+        llama_grammar *grammar = slot.ctx_sampling->grammar;
+        if (grammar != nullptr && slot.n_grammar_full > 0)
+        {
+            slot.n_grammar_full--;
+        }
+        else if (grammar != nullptr)
+        {
+            if (grammar_trie.mask(ctx, grammar, llama_get_logits_ith(ctx, idx), llama_n_vocab(model) / 2))
+            {
+                slot.ctx_sampling->grammar = nullptr;
+            }
+            else
+            {
+                slot.n_grammar_full = 16;
+            }
+        }
+
+        const llama_token id = llama_fused_sampler::supported(slot.ctx_sampling) ?
+            slot.fused_sampler.sample(slot.ctx_sampling, model, logits != nullptr ? logits : llama_get_logits_ith(ctx, idx)) :
+            llama_sampling_sample(slot.ctx_sampling, ctx, NULL, idx);
+
+        slot.ctx_sampling->grammar = grammar;
+        llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+        slot.n_decoded += 1;
+        if (slot.n_decoded == 1)
+        {
+            slot.t_start_genereration = ggml_time_us();
+            slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
+        }
+
+        llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+        result.tok = id;
+
+        const int32_t n_probs = slot.sparams.n_probs;
+        const bool greedy = slot.sparams.temp <= 0;
+        if (greedy && n_probs > 0)
+        {
+            // greedy sampling leaves the candidates unsorted and without probabilities
+            slot.logprobs.top_n(cur_p, n_probs, result.probs);
+        }
+        else
+        {
+            for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+            {
+                result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+            }
+        }
+
+        // the probability of the sampled token, which need not be among the top n_probs
+        result.prob = 0.0f;
+        if (n_probs > 0)
+        {
+            for (size_t i = 0; i < cur_p.size; i++)
+            {
+                if (cur_p.data[i].id == id)
+                {
+                    result.prob = greedy ? slot.logprobs.prob(i) : cur_p.data[i].p;
+                    break;
+                }
+            }
+        }
+
+        return process_token(result, slot);
+    }
+
     void run_on_all_tasks_finished() {
         update_slots();
     }
@@ -1992,7 +4067,7 @@ static json format_partial_response(
 
     if (slot->sparams.n_probs > 0)
     {
-        res["completion_probabilities"] = probs_vector_to_json(llama.ctx, probs);
+        res["completion_probabilities"] = probs_vector_to_json(llama.vocab_pieces, probs);
     }
 
     return res;
@@ -2000,24 +4075,23 @@ static json format_partial_response(
 
 struct token_translator
 {
-    llama_context * ctx;
-    std::string operator()(llama_token tok)                    const { return llama_token_to_piece(ctx, tok); }
-    std::string operator()(const completion_token_output &cto) const { return (*this)(cto.tok); }
+    const llama_vocab_pieces & pieces;
+    std::string_view operator()(llama_token tok) const { return pieces.get(tok); }
 };
 
 static void append_to_generated_text_from_generated_token_probs(llama_server_context &llama, llama_client_slot *slot)
 {
-    auto & gtps = slot->generated_token_probs;
-    auto translator = token_translator{llama.ctx};
-    auto add_strlen = [=](size_t sum, const completion_token_output & cto) { return sum + translator(cto).size(); };
+    auto & gtps = slot->generated_token_probs.tokens;
+    auto translator = token_translator{llama.vocab_pieces};
+    auto add_strlen = [=](size_t sum, llama_token tok) { return sum + translator(tok).size(); };
     const size_t len = std::accumulate(gtps.begin(), gtps.end(), size_t(0), add_strlen);
     if (slot->generated_text.capacity() < slot->generated_text.size() + len)
     {
         slot->generated_text.reserve(slot->generated_text.size() + len);
     }
-    for (const completion_token_output & cto : gtps)
+    for (llama_token tok : gtps)
     {
-        slot->generated_text += translator(cto);
+        slot->generated_text += translator(tok);
     }
 }
 
@@ -2035,6 +4109,9 @@ bool loaded_model; // TODO: add a mutex for this, but happens only once loading
 // The class has a llama instance that is shared across all RPCs
 llama_server_context llama;
 
+// Vector store of the Stores* RPCs, independent of the model
+vector_store stores;
+
 static void start_llama_server() {
     // Wait for model to be loaded first
     while (!loaded_model) {
@@ -2106,6 +4183,18 @@ json parse_options(bool streaming, const backend::PredictOptions* predict, llama
     data["grammar"] = predict->grammar();
     data["prompt"] = predict->prompt();
     data["ignore_eos"] = predict->ignoreeos();
+    data["priority"] = predict->priority();
+    data["n_probs"] = predict->nprobs();
+    for (int i = 0; i < predict->stoptokens_size(); i++) {
+        data["stop_tokens"].push_back(predict->stoptokens(i));
+    }
+    if (!predict->systemprompt().empty()) {
+        data["system_prompt"] = json
+            {
+                {"prompt", predict->systemprompt()},
+                {"name",   predict->systempromptname()},
+            };
+    }
 
     // for each image in the request, add the image data
     //
@@ -2118,12 +4207,52 @@ json parse_options(bool streaming, const backend::PredictOptions* predict, llama
     }
 
     data["stop"] = predict->stopprompts();
-    // data["n_probs"] = predict->nprobs();
+    if (predict->n() > 1)
+    {
+        data["n"] = predict->n();
+    }
+    if (predict->nbeams() > 1)
+    {
+        data["n_beams"] = predict->nbeams();
+    }
     //TODO: images,
 
     return data;
 }
 
+// the completions of a request with N > 1, the first one is also the message
+static void set_reply_choices(const json &results, backend::Reply *reply)
+{
+    int32_t tokens_predicted = 0;
+    for (const json &res : results)
+    {
+        reply->add_choices(res.value("content", ""));
+        tokens_predicted += res.value("tokens_predicted", 0);
+    }
+    reply->set_tokens(tokens_predicted);
+    if (!results.empty())
+    {
+        reply->set_message(results[0].value("content", ""));
+        reply->set_prompt_tokens(results[0].value("tokens_evaluated", 0));
+    }
+}
+
+// the reply of the final result of a completion
+static void set_reply(const json &result, backend::Reply *reply)
+{
+    if (result.contains("results"))
+    {
+        set_reply_choices(result["results"], reply);
+        return;
+    }
+    reply->set_message(result.value("content", ""));
+    reply->set_tokens(result.value("tokens_predicted", 0));
+    reply->set_prompt_tokens(result.value("tokens_evaluated", 0));
+    if (result.contains("completion_probabilities")) {
+        reply->set_logprobs(result["completion_probabilities"].dump(-1, ' ', false, json::error_handler_t::replace));
+    }
+}
+
 // static void parse_options_completion(bool streaming,const backend::PredictOptions* predict, llama_server_context &llama)
 // {
 //     // https://github.com/ggerganov/llama.cpp/blob/d9b33fe95bd257b36c84ee5769cc048230067d6f/examples/server/server.cpp#L673
@@ -2191,7 +4320,7 @@ json parse_options(bool streaming, const backend::PredictOptions* predict, llama
 // }
 
 static void params_parse(const backend::ModelOptions* request,
-                                gpt_params & params) {
+                                gpt_params & params, server_params & sparams) {
    
     // this is comparable to: https://github.com/ggerganov/llama.cpp/blob/d9b33fe95bd257b36c84ee5769cc048230067d6f/examples/server/server.cpp#L1809
 
@@ -2217,6 +4346,61 @@ static void params_parse(const backend::ModelOptions* request,
     } else {
         params.n_parallel = 1;
     }
+    // Share the whole context between the slots (LLAMACPP_ELASTIC_CTX), instead of splitting it evenly
+    const char *env_elastic_ctx = std::getenv("LLAMACPP_ELASTIC_CTX");
+    if (env_elastic_ctx != NULL) {
+        sparams.elastic_ctx = std::string(env_elastic_ctx) == "1" || std::string(env_elastic_ctx) == "true";
+    }
+    // Keep the KV state of preempted slots on disk (LLAMACPP_SWAP_PATH) instead of host memory
+    const char *env_swap_path = std::getenv("LLAMACPP_SWAP_PATH");
+    if (env_swap_path != NULL) {
+        sparams.swap_path = env_swap_path;
+    }
+    // Number of system prompts kept in the KV cache (LLAMACPP_SYSTEM_PROMPTS), 0 disables them
+    const char *env_system_prompts = std::getenv("LLAMACPP_SYSTEM_PROMPTS");
+    if (env_system_prompts != NULL) {
+        sparams.n_system_prompts = std::stoi(env_system_prompts);
+    }
+    // Additional end-of-generation token texts (LLAMACPP_EOG_TOKENS), comma separated
+    const char *env_eog_tokens = std::getenv("LLAMACPP_EOG_TOKENS");
+    if (env_eog_tokens != NULL) {
+        std::stringstream ss(env_eog_tokens);
+        std::string text;
+        while (std::getline(ss, text, ',')) {
+            if (!text.empty()) {
+                sparams.eog_tokens.push_back(text);
+            }
+        }
+    }
+    // Threads sampling the parallel slots concurrently (LLAMACPP_SAMPLING_THREADS), defaults to 0 (sampling on the main thread)
+    const char *env_sampling_threads = std::getenv("LLAMACPP_SAMPLING_THREADS");
+    if (env_sampling_threads != NULL) {
+        sparams.n_sampling_threads = std::stoi(env_sampling_threads);
+    }
+    // Serve embeddings only (LLAMACPP_EMBEDDING_ONLY), packing up to LLAMACPP_EMBEDDING_SEQS inputs per batch
+    const char *env_embedding_only = std::getenv("LLAMACPP_EMBEDDING_ONLY");
+    if (env_embedding_only != NULL) {
+        sparams.embedding_only = std::string(env_embedding_only) == "1" || std::string(env_embedding_only) == "true";
+    }
+    const char *env_embedding_seqs = std::getenv("LLAMACPP_EMBEDDING_SEQS");
+    if (env_embedding_seqs != NULL) {
+        sparams.n_embedding_seqs = std::max(1, std::stoi(env_embedding_seqs));
+    }
+    // Prompt of the (query, document) pairs reranked by causal models (LLAMACPP_RERANK_TEMPLATE),
+    // and the comma separated texts of the tokens whose logits give the relevance (LLAMACPP_RERANK_TOKENS)
+    const char *env_rerank_template = std::getenv("LLAMACPP_RERANK_TEMPLATE");
+    if (env_rerank_template != NULL) {
+        sparams.rerank_template = env_rerank_template;
+    }
+    const char *env_rerank_tokens = std::getenv("LLAMACPP_RERANK_TOKENS");
+    if (env_rerank_tokens != NULL) {
+        const std::string tokens = env_rerank_tokens;
+        const size_t comma = tokens.find(',');
+        if (comma != std::string::npos) {
+            sparams.rerank_yes = tokens.substr(0, comma);
+            sparams.rerank_no  = tokens.substr(comma + 1);
+        }
+    }
     // TODO: Add yarn
 
     if (!request->tensorsplit().empty()) {
@@ -2255,6 +4439,11 @@ static void params_parse(const backend::ModelOptions* request,
     params.use_mlock = request->mlock();
     params.use_mmap = request->mmap();
     params.embedding = request->embeddings();
+    // the pinned llama.cpp has no LLAMA_POOLING_TYPE_LAST: without pooling the embedding is the one of the last token
+    if (request->poolingtype() == "none" || request->poolingtype() == "last") { params.pooling_type = LLAMA_POOLING_TYPE_NONE; }
+    else if (request->poolingtype() == "mean") { params.pooling_type = LLAMA_POOLING_TYPE_MEAN; }
+    else if (request->poolingtype() == "cls")  { params.pooling_type = LLAMA_POOLING_TYPE_CLS; }
+    sparams.normalize_embeddings = request->normalizeembeddings();
 
     if (request->ropescaling() == "none")   { params.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE; }
     else if (request->ropescaling() == "yarn")   { params.rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_YARN; }
@@ -2292,13 +4481,14 @@ public:
   grpc::Status LoadModel(ServerContext* context, const backend::ModelOptions* request, backend::Result* result) {
     // Implement LoadModel RPC
     gpt_params params;
-    params_parse(request, params);
+    server_params sparams;
+    params_parse(request, params, sparams);
 
     llama_backend_init();
     llama_numa_init(params.numa);
 
     // load the model
-    if (!llama.load_model(params))
+    if (!llama.load_model(params, sparams))
     {
         result->set_message("Failed loading model");
         result->set_success(false);
@@ -2328,10 +4518,19 @@ public:
                 });
 
                 backend::Reply reply;
+                if (result.result_json.contains("results"))
+                {
+                    set_reply_choices(result.result_json["results"], &reply);
+                    writer->Write(reply);
+                    break;
+                }
                 // print it
                 std::string completion_text = result.result_json.value("content", "");
 
                 reply.set_message(completion_text);
+                if (result.result_json.contains("completion_probabilities")) {
+                    reply.set_logprobs(result.result_json["completion_probabilities"].dump(-1, ' ', false, json::error_handler_t::replace));
+                }
                 int32_t tokens_predicted = result.result_json.value("tokens_predicted", 0);
                 reply.set_tokens(tokens_predicted);
                 int32_t tokens_evaluated = result.result_json.value("tokens_evaluated", 0);
@@ -2344,36 +4543,374 @@ public:
                     break;
                 }
             } else {
-                break;
+                llama.queue_results.remove_waiting_task_id(task_id);
+                return grpc::Status(grpc::StatusCode::INTERNAL, result.result_json.value("content", "completion failed"));
+            }
+        }
+
+        return grpc::Status::OK;
+    }
+
+
+    grpc::Status StoresSet(ServerContext* context, const backend::StoresSetOptions* request, backend::Result* result) {
+        if (request->keys_size() == 0 || request->keys_size() != request->values_size()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "expected as many values as keys, and at least one");
+        }
+
+        std::unique_lock<std::shared_mutex> lock(stores.mutex);
+        std::string error;
+        const int n_dim = request->keys(0).floats_size();
+        for (const backend::StoresKey &key : request->keys()) {
+            if (!stores.check_dim(key.floats_size(), error)) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, error);
+            }
+            if (key.floats_size() != n_dim) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "keys of lengths " + std::to_string(n_dim) + " and " +
+                                    std::to_string(key.floats_size()) + " in the same request");
+            }
+        }
+        stores.init_dim(n_dim);
+        for (int i = 0; i < request->keys_size(); i++) {
+            if (!stores.set(request->keys(i).floats().data(), request->values(i).bytes(), error)) {
+                return grpc::Status(grpc::StatusCode::INTERNAL, error);
+            }
+        }
+        stores.flush();
+
+        result->set_success(true);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status StoresDelete(ServerContext* context, const backend::StoresDeleteOptions* request, backend::Result* result) {
+        std::unique_lock<std::shared_mutex> lock(stores.mutex);
+        std::string error;
+        for (const backend::StoresKey &key : request->keys()) {
+            if (!stores.check_dim(key.floats_size(), error)) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, error);
+            }
+        }
+        for (const backend::StoresKey &key : request->keys()) {
+            if (!stores.remove(key.floats().data(), error)) {
+                return grpc::Status(grpc::StatusCode::INTERNAL, error);
+            }
+        }
+        stores.flush();
+
+        result->set_success(true);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status StoresGet(ServerContext* context, const backend::StoresGetOptions* request, backend::StoresGetResult* result) {
+        std::shared_lock<std::shared_mutex> lock(stores.mutex);
+        std::string error;
+        for (const backend::StoresKey &key : request->keys()) {
+            if (!stores.check_dim(key.floats_size(), error)) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, error);
+            }
+        }
+        for (const backend::StoresKey &key : request->keys()) {
+            const int64_t row = stores.find_row(key.floats().data());
+            if (row >= 0) {
+                *result->add_keys() = key;
+                result->add_values()->set_bytes(stores.value(row));
             }
         }
 
         return grpc::Status::OK;
     }
 
+    grpc::Status StoresFind(ServerContext* context, const backend::StoresFindOptions* request, backend::StoresFindResult* result) {
+        std::shared_lock<std::shared_mutex> lock(stores.mutex);
+        if (stores.size() == 0 || request->topk() <= 0) {
+            return grpc::Status::OK;
+        }
+        if (request->key().floats_size() != stores.dim()) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "key of length " + std::to_string(request->key().floats_size()) +
+                                " in a store of keys of length " + std::to_string(stores.dim()));
+        }
+
+        std::vector<vector_store::match> matches;
+        stores.find(request->key().floats().data(), request->topk(), matches);
+        for (const vector_store::match &m : matches) {
+            const float *key = stores.key(m.row);
+            result->add_keys()->mutable_floats()->Add(key, key + stores.dim());
+            result->add_values()->set_bytes(stores.value(m.row));
+            result->add_similarities(m.similarity);
+        }
+
+        return grpc::Status::OK;
+    }
+
+    grpc::Status Embedding(ServerContext* context, const backend::PredictOptions* request, backend::EmbeddingResult* embeddingResult) {
+        if (!loaded_model) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "model not loaded");
+        }
+        if (!llama.params.embedding) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "the model was loaded without embeddings");
+        }
+
+        json prompt = request->embeddings();
+        if (request->embeddingtokens_size() > 0) {
+            prompt = std::vector<int>(request->embeddingtokens().begin(), request->embeddingtokens().end());
+        }
+        const int task_id = llama.queue_tasks.get_new_id();
+        llama.queue_results.add_waiting_task_id(task_id);
+        llama.request_completion(task_id, { {"prompt", prompt}, {"n_predict", 0} }, false, true, -1);
+        task_result result = llama.queue_results.recv(task_id);
+        llama.queue_results.remove_waiting_task_id(task_id);
+
+        if (result.error) {
+            return grpc::Status(grpc::StatusCode::INTERNAL, result.result_json.value("content", "embedding failed"));
+        }
+        const std::vector<float> embedding = result.result_json.value("embedding", std::vector<float>());
+        embeddingResult->mutable_embeddings()->Add(embedding.begin(), embedding.end());
+
+        return grpc::Status::OK;
+    }
+
+    // Embeddings of a stream of texts, streamed back as they finish with the index of their text.
+    // The texts are read by windows, each tokenized in parallel and posted by increasing token
+    // length so that the batches group inputs of similar lengths; one window is queued ahead of
+    // the one being received to keep the batches full. When the stream ends early, on an error or
+    // a client gone, the tasks of the texts left are cancelled.
+    grpc::Status EmbeddingBulk(ServerContext* context, grpc::ServerReaderWriter<backend::EmbeddingResult, backend::EmbeddingBulkRequest>* stream) {
+        if (!loaded_model) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "model not loaded");
+        }
+        if (!llama.params.embedding) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "the model was loaded without embeddings");
+        }
+
+        const size_t n_window = 1024;
+        std::vector<std::string> texts;
+        int64_t n_texts = 0;
+        bool reading = true;
+        std::unordered_map<int, int64_t> indices; // of the texts of the pending tasks
+        std::unordered_set<int> pending;
+        grpc::Status status = grpc::Status::OK;
+
+        while (status.ok() && (reading || !pending.empty())) {
+            backend::EmbeddingBulkRequest request;
+            while (reading && texts.size() < n_window) {
+                if (context->IsCancelled()) {
+                    status = grpc::Status(grpc::StatusCode::CANCELLED, "the client cancelled the request");
+                    break;
+                }
+                if (!stream->Read(&request)) {
+                    reading = false;
+                    break;
+                }
+                texts.insert(texts.end(), request.texts().begin(), request.texts().end());
+            }
+
+            if (status.ok() && !texts.empty()) {
+                std::vector<std::vector<llama_token>> tokens = llama.tokenize_texts(texts);
+                std::vector<size_t> order(texts.size());
+                std::iota(order.begin(), order.end(), 0);
+                std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return tokens[a].size() < tokens[b].size(); });
+
+                std::vector<int> task_ids;
+                std::vector<std::vector<llama_token>> inputs;
+                std::unordered_set<int> window;
+                for (const size_t i : order) {
+                    const int task_id = llama.queue_tasks.get_new_id();
+                    task_ids.push_back(task_id);
+                    inputs.push_back(std::move(tokens[i]));
+                    window.insert(task_id);
+                    indices[task_id] = n_texts + i;
+                }
+                llama.queue_results.add_waiting_task_ids(window);
+                llama.request_embeddings(task_ids, inputs);
+                pending.insert(window.begin(), window.end());
+
+                n_texts += texts.size();
+                texts.clear();
+            }
+
+            while (status.ok() && !pending.empty() && (pending.size() > n_window || !reading)) {
+                task_result result;
+                if (!llama.queue_results.recv(pending, std::chrono::milliseconds(100), result)) {
+                    if (context->IsCancelled()) {
+                        status = grpc::Status(grpc::StatusCode::CANCELLED, "the client cancelled the request");
+                    }
+                    continue;
+                }
+                llama.queue_results.remove_waiting_task_id(result.id);
+                pending.erase(result.id);
+                const int64_t index = indices[result.id];
+                indices.erase(result.id);
+
+                if (result.error) {
+                    status = grpc::Status(grpc::StatusCode::INTERNAL, "text " + std::to_string(index) + ": " +
+                                          result.result_json.value("content", "embedding failed"));
+                    break;
+                }
+                backend::EmbeddingResult embedding_result;
+                const std::vector<float> embedding = result.result_json.value("embedding", std::vector<float>());
+                embedding_result.mutable_embeddings()->Add(embedding.begin(), embedding.end());
+                embedding_result.set_index(index);
+                if (!stream->Write(embedding_result)) {
+                    status = grpc::Status(grpc::StatusCode::CANCELLED, "the client closed the stream");
+                    break;
+                }
+            }
+        }
+
+        // the tasks left are cancelled, and the results they may still send dropped
+        llama.request_cancel(pending);
+        llama.queue_results.remove_waiting_task_ids(pending);
+        return status;
+    }
+
+    grpc::Status Rerank(ServerContext* context, const backend::RerankRequest* request, backend::RerankResult* rerankResult) {
+        if (!loaded_model) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "model not loaded");
+        }
+        // llama.cpp has no classification pooling yet, the pooled embedding of a cross-encoder is not a score
+        if (llama.params.embedding) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "reranking needs a causal model loaded without embeddings");
+        }
+        if (request->documents_size() == 0) {
+            return grpc::Status::OK;
+        }
+
+        const std::vector<std::string> documents(request->documents().begin(), request->documents().end());
+        const int task_id = llama.queue_tasks.get_new_id();
+        llama.queue_results.add_waiting_task_id(task_id);
+        llama.request_rerank(task_id, request->query(), documents);
+        task_result result = llama.queue_results.recv(task_id);
+        llama.queue_results.remove_waiting_task_id(task_id);
+
+        if (result.error) {
+            return grpc::Status(grpc::StatusCode::INTERNAL, result.result_json.value("content", "rerank failed"));
+        }
+
+        const json &results = result.result_json["results"];
+        std::vector<std::pair<float, int>> ranked;
+        int32_t n_tokens = 0;
+        for (size_t i = 0; i < results.size(); i++) {
+            ranked.push_back({ results[i].value("score", 0.0f), (int) i });
+            n_tokens += results[i].value("tokens_evaluated", 0);
+        }
+
+        size_t top_n = ranked.size();
+        if (request->top_n() > 0 && (size_t) request->top_n() < top_n) {
+            top_n = request->top_n();
+        }
+        std::partial_sort(ranked.begin(), ranked.begin() + top_n, ranked.end(), [](const std::pair<float, int> &a, const std::pair<float, int> &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+
+        for (size_t i = 0; i < top_n; i++) {
+            backend::DocumentResult *doc = rerankResult->add_results();
+            doc->set_index(ranked[i].second);
+            doc->set_text(documents[ranked[i].second]);
+            doc->set_relevance_score(ranked[i].first);
+        }
+        rerankResult->mutable_usage()->set_prompt_tokens(n_tokens);
+        rerankResult->mutable_usage()->set_total_tokens(n_tokens);
+
+        return grpc::Status::OK;
+    }
 
     grpc::Status Predict(ServerContext* context, const backend::PredictOptions* request, backend::Reply* reply) {
         json data = parse_options(false, request, llama);
         const int task_id = llama.queue_tasks.get_new_id();
         llama.queue_results.add_waiting_task_id(task_id);
         llama.request_completion(task_id, data, false, false, -1);
-        std::string completion_text;
         task_result result = llama.queue_results.recv(task_id);
-        if (!result.error && result.stop) {
-            completion_text = result.result_json.value("content", "");
-            int32_t tokens_predicted = result.result_json.value("tokens_predicted", 0);
-            int32_t tokens_evaluated = result.result_json.value("tokens_evaluated", 0);
-            reply->set_prompt_tokens(tokens_evaluated);
-            reply->set_tokens(tokens_predicted);
-            reply->set_message(completion_text);
+        llama.queue_results.remove_waiting_task_id(task_id);
+        if (result.error) {
+            return grpc::Status(grpc::StatusCode::INTERNAL, result.result_json.value("content", "completion failed"));
         }
-        else
-        {
-            return grpc::Status::OK;
+        if (result.stop) {
+            set_reply(result.result_json, reply);
         }
 
         return grpc::Status::OK;
     }
+
+    // Completions of a stream of prompts, for offline batch jobs. Each reply is the final result
+    // of one prompt, streamed back as soon as it finishes with the index of its prompt. The prompts
+    // are read by windows posted to the task queue at once, so that the slots are filled from the
+    // backlog; one window is queued ahead of the one being received. Results therefore come back
+    // once the next window has been read, or the client has closed its side of the stream. A
+    // prompt that fails gets a reply with its error; when the stream ends early, on a client gone,
+    // the tasks of the prompts left are cancelled.
+    grpc::Status PredictBulk(ServerContext* context, grpc::ServerReaderWriter<backend::Reply, backend::PredictOptions>* stream) {
+        if (!loaded_model) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "model not loaded");
+        }
+
+        const size_t n_window = std::max<size_t>(256, 4 * llama.slots.size());
+        int64_t n_prompts = 0;
+        bool reading = true;
+        std::unordered_map<int, int64_t> indices; // of the prompts of the pending tasks
+        std::unordered_set<int> pending;
+        grpc::Status status = grpc::Status::OK;
+
+        while (status.ok() && (reading || !pending.empty())) {
+            std::vector<int> task_ids;
+            std::vector<json> datas;
+            backend::PredictOptions request;
+            while (reading && task_ids.size() < n_window) {
+                if (context->IsCancelled()) {
+                    status = grpc::Status(grpc::StatusCode::CANCELLED, "the client cancelled the request");
+                    break;
+                }
+                if (!stream->Read(&request)) {
+                    reading = false;
+                    break;
+                }
+                const int task_id = llama.queue_tasks.get_new_id();
+                task_ids.push_back(task_id);
+                datas.push_back(parse_options(false, &request, llama));
+                indices[task_id] = n_prompts++;
+            }
+
+            if (status.ok() && !task_ids.empty()) {
+                const std::unordered_set<int> window(task_ids.begin(), task_ids.end());
+                llama.queue_results.add_waiting_task_ids(window);
+                llama.request_completions(task_ids, datas);
+                pending.insert(window.begin(), window.end());
+            }
+
+            while (status.ok() && !pending.empty() && (pending.size() > n_window || !reading)) {
+                task_result result;
+                if (!llama.queue_results.recv(pending, std::chrono::milliseconds(100), result)) {
+                    if (context->IsCancelled()) {
+                        status = grpc::Status(grpc::StatusCode::CANCELLED, "the client cancelled the request");
+                    }
+                    continue;
+                }
+                if (!result.error && !result.stop) {
+                    continue;
+                }
+                llama.queue_results.remove_waiting_task_id(result.id);
+                pending.erase(result.id);
+                const int64_t index = indices[result.id];
+                indices.erase(result.id);
+
+                // a failed prompt is reported in its reply, the others go on
+                backend::Reply reply;
+                if (result.error) {
+                    reply.set_error(result.result_json.value("content", "completion failed"));
+                } else {
+                    set_reply(result.result_json, &reply);
+                }
+                reply.set_index(index);
+                if (!stream->Write(reply)) {
+                    status = grpc::Status(grpc::StatusCode::CANCELLED, "the client closed the stream");
+                    break;
+                }
+            }
+        }
+
+        // the tasks left are cancelled, and the results they may still send dropped
+        llama.request_cancel(pending);
+        llama.queue_results.remove_waiting_task_ids(pending);
+        return status;
+    }
 };
 
 void RunServer(const std::string& server_address) {
@@ -2411,6 +4948,63 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Index of the vector store (LLAMACPP_STORES_INDEX), "hnsw" or the default exact scan, and the
+  // HNSW links per node and beam widths of the insertions and of the searches
+  const char *env_stores_index = std::getenv("LLAMACPP_STORES_INDEX");
+  if (env_stores_index != NULL) {
+    stores.use_index = std::string(env_stores_index) == "hnsw";
+  }
+  const char *env_hnsw_m = std::getenv("LLAMACPP_STORES_HNSW_M");
+  if (env_hnsw_m != NULL) {
+    stores.index.M = std::max(2, std::stoi(env_hnsw_m));
+  }
+  const char *env_hnsw_ef_construction = std::getenv("LLAMACPP_STORES_HNSW_EF_CONSTRUCTION");
+  if (env_hnsw_ef_construction != NULL) {
+    stores.index.ef_construction = std::max(1, std::stoi(env_hnsw_ef_construction));
+  }
+  const char *env_hnsw_ef_search = std::getenv("LLAMACPP_STORES_HNSW_EF_SEARCH");
+  if (env_hnsw_ef_search != NULL) {
+    stores.index.ef_search = std::max(1, std::stoi(env_hnsw_ef_search));
+  }
+  // Quantization of the keys scanned by the vector store (LLAMACPP_STORES_QUANTIZATION), "int8" or "binary",
+  // and the multiple of the requested matches re-ranked with the float keys (LLAMACPP_STORES_RERANK), 0 disables it
+  const char *env_stores_quantization = std::getenv("LLAMACPP_STORES_QUANTIZATION");
+  if (env_stores_quantization != NULL) {
+    const std::string quantization = env_stores_quantization;
+    if (quantization == "int8") {
+      stores.quantization = KEY_QUANTIZATION_INT8;
+    } else if (quantization == "binary") {
+      stores.quantization = KEY_QUANTIZATION_BINARY;
+    } else if (!quantization.empty()) {
+      std::cerr << "unknown LLAMACPP_STORES_QUANTIZATION \"" << quantization << "\", expected int8 or binary" << std::endl;
+      return 1;
+    }
+  }
+  const char *env_stores_rerank = std::getenv("LLAMACPP_STORES_RERANK");
+  if (env_stores_rerank != NULL) {
+    stores.rerank = std::max(0, std::stoi(env_stores_rerank));
+  }
+  // Directory of a persistent vector store (LLAMACPP_STORES_PATH), opened at startup; the store is in memory without it
+  const char *env_stores_path = std::getenv("LLAMACPP_STORES_PATH");
+  // the codes are scanned instead of the float keys, which are still kept for the re-ranking and the
+  // returned keys: they only save memory when the float keys are mapped from files and can be paged
+  // out, and the HNSW index searches the float keys
+  if (stores.quantization != KEY_QUANTIZATION_NONE && stores.use_index) {
+    std::cerr << "LLAMACPP_STORES_QUANTIZATION does not apply to the hnsw index, unset one of them" << std::endl;
+    return 1;
+  }
+  if (stores.quantization != KEY_QUANTIZATION_NONE && env_stores_path == NULL) {
+    std::cerr << "LLAMACPP_STORES_QUANTIZATION needs a persistent store in LLAMACPP_STORES_PATH, an in-memory store would hold the codes besides the float keys" << std::endl;
+    return 1;
+  }
+  if (env_stores_path != NULL) {
+    std::string error;
+    if (!stores.open(env_stores_path, error)) {
+      std::cerr << "failed to open the vector store: " << error << std::endl;
+      return 1;
+    }
+  }
+
    // run the HTTP server in a thread - see comment below
     std::thread t([&]()
             {
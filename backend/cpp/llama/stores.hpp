@@ -0,0 +1,1657 @@
+// In-process vector store behind the Stores* RPCs
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static inline float simd_dot(const float *a, const float *b, size_t n)
+{
+    float sum = 0.0f;
+    size_t i = 0;
+#if defined(__AVX__)
+    // four independent accumulators hide the latency of the adds
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    for (; i + 32 <= n; i += 32)
+    {
+#if defined(__FMA__)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),      _mm256_loadu_ps(b + i),      acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),  _mm256_loadu_ps(b + i + 8),  acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+#else
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i),      _mm256_loadu_ps(b + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8),  _mm256_loadu_ps(b + i + 8)));
+        acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16)));
+        acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24)));
+#endif
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for (const float lane : lanes)
+    {
+        sum += lane;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f);
+    float32x4_t acc3 = vdupq_n_f32(0.0f);
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),      vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4),  vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8),  vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4)
+    {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    sum = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+#endif
+    for (; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static inline int32_t simd_dot_i8(const int8_t *a, const int8_t *b, size_t n)
+{
+    int32_t sum = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    // widened to 16 bits, the products are added by pairs into 32 bits
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (a + i)));
+        const __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (b + i)));
+        const __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (a + i + 16)));
+        const __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (b + i + 16)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a0, b0));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a1, b1));
+    }
+    __m128i acc4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    acc4 = _mm_hadd_epi32(acc4, acc4);
+    acc4 = _mm_hadd_epi32(acc4, acc4);
+    sum = _mm_cvtsi128_si32(acc4);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16)
+    {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_high_s8(va, vb));
+    }
+    sum = vaddvq_s32(acc);
+#endif
+    for (; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// number of differing bits of n bytes
+static inline uint32_t simd_hamming(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint32_t sum = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    // bits of each nibble counted by a table lookup, the bytes summed per 64 bits
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i)));
+        const __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(x, nibble)),
+                                              _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(count, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 16 <= n; i += 16)
+    {
+        sum += vaddvq_u8(vcntq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    }
+#endif
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t x;
+        uint64_t y;
+        std::memcpy(&x, a + i, 8);
+        std::memcpy(&y, b + i, 8);
+        sum += __builtin_popcountll(x ^ y);
+    }
+    for (; i < n; i++)
+    {
+        sum += __builtin_popcount(a[i] ^ b[i]);
+    }
+    return sum;
+}
+
+// Growable bytes, in memory or in a file mapped in memory. A mapped file grows by doubling: it is
+// extended and mapped again, so pointers into the buffer are only valid until the next reserve.
+struct store_buffer
+{
+    std::vector<uint8_t> memory;
+    int fd = -1;
+    uint8_t *mapped = nullptr;
+    size_t capacity = 0;
+
+    store_buffer() = default;
+    store_buffer(const store_buffer &) = delete;
+    store_buffer &operator=(const store_buffer &) = delete;
+
+    ~store_buffer()
+    {
+        close();
+    }
+
+    // map a file, created if missing, with its current size as the capacity
+    bool open(const std::string &path, bool truncate, std::string &error)
+    {
+        close();
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        if (fd < 0)
+        {
+            error = "failed to open " + path + ": " + std::strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            error = "failed to stat " + path + ": " + std::strerror(errno);
+            return false;
+        }
+        return map(st.st_size, error);
+    }
+
+    void close()
+    {
+        if (mapped != nullptr)
+        {
+            munmap(mapped, capacity);
+            mapped = nullptr;
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+        memory.clear();
+        capacity = 0;
+    }
+
+    void swap(store_buffer &other)
+    {
+        std::swap(memory, other.memory);
+        std::swap(fd, other.fd);
+        std::swap(mapped, other.mapped);
+        std::swap(capacity, other.capacity);
+    }
+
+    uint8_t *data()
+    {
+        return fd >= 0 ? mapped : memory.data();
+    }
+
+    const uint8_t *data() const
+    {
+        return fd >= 0 ? mapped : memory.data();
+    }
+
+    bool reserve(size_t size, std::string &error)
+    {
+        if (size <= capacity)
+        {
+            return true;
+        }
+        size = std::max(size, std::max<size_t>(capacity * 2, 1 << 16));
+        if (fd < 0)
+        {
+            memory.resize(size);
+            capacity = size;
+            return true;
+        }
+        if (ftruncate(fd, size) != 0)
+        {
+            error = std::string("failed to extend a store file: ") + std::strerror(errno);
+            return false;
+        }
+        return map(size, error);
+    }
+
+    // write the dirty pages back, waiting for them when sync is set
+    void flush(bool sync) const
+    {
+        if (mapped != nullptr)
+        {
+            msync(mapped, capacity, sync ? MS_SYNC : MS_ASYNC);
+        }
+    }
+
+private:
+    bool map(size_t size, std::string &error)
+    {
+        if (mapped != nullptr)
+        {
+            munmap(mapped, capacity);
+            mapped = nullptr;
+        }
+        capacity = size;
+        if (size == 0)
+        {
+            return true;
+        }
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            capacity = 0;
+            error = std::string("failed to map a store file: ") + std::strerror(errno);
+            return false;
+        }
+        mapped = (uint8_t *) addr;
+        return true;
+    }
+};
+
+// Keys as rows of one buffer, so that a search streams through memory. A row holds the key, its
+// inverse norm, then padding to a multiple of 64 bytes: the rows stay aligned to cache lines and to
+// the vector registers. The similarity is the cosine, a dot product scaled by the inverse norms.
+struct vector_rows
+{
+    int32_t dim = -1;
+    size_t stride = 0; // floats per row
+
+    store_buffer keys;
+
+    void set_dim(int32_t n)
+    {
+        dim    = n;
+        stride = (dim + 1 + 15) / 16 * 16;
+    }
+
+    size_t row_bytes() const
+    {
+        return stride * sizeof(float);
+    }
+
+    float *row(size_t r)
+    {
+        return (float *) keys.data() + r * stride;
+    }
+
+    const float *key(size_t r) const
+    {
+        return (const float *) keys.data() + r * stride;
+    }
+
+    float inv_norm(size_t r) const
+    {
+        return key(r)[dim];
+    }
+
+    static float compute_inv_norm(const float *k, size_t n)
+    {
+        const float norm = std::sqrt(simd_dot(k, k, n));
+        return norm > 0.0f ? 1.0f / norm : 0.0f;
+    }
+
+    float similarity(const float *q, float q_inv_norm, size_t r) const
+    {
+        return simd_dot(q, key(r), dim) * q_inv_norm * inv_norm(r);
+    }
+
+    float similarity(size_t a, size_t b) const
+    {
+        return similarity(key(a), inv_norm(a), b);
+    }
+};
+
+enum key_quantization
+{
+    KEY_QUANTIZATION_NONE,
+    KEY_QUANTIZATION_INT8,   // a signed byte per dimension of the normalized key, then its scale
+    KEY_QUANTIZATION_BINARY, // a bit per dimension, its sign
+};
+
+// Compressed copies of the key rows, scanned instead of them: the float rows are only read to re-rank
+// the best candidates, so with a store mapped from files they can stay on disk. The int8 codes
+// estimate the cosine by a scaled dot product, the binary ones by the angle given by the share of
+// differing signs.
+struct key_codes
+{
+    key_quantization quantization = KEY_QUANTIZATION_NONE;
+    int32_t dim = 0;
+    size_t stride = 0; // bytes per code
+
+    store_buffer bytes;
+
+    void set_format(key_quantization q, int32_t n)
+    {
+        quantization = q;
+        dim          = n;
+        if (quantization == KEY_QUANTIZATION_INT8)
+        {
+            stride = (scale_offset() + sizeof(float) + 15) / 16 * 16;
+        }
+        else if (quantization == KEY_QUANTIZATION_BINARY)
+        {
+            stride = (dim + 63) / 64 * 8;
+        }
+        else
+        {
+            stride = 0;
+        }
+    }
+
+    uint8_t *code(size_t row)
+    {
+        return bytes.data() + row * stride;
+    }
+
+    const uint8_t *code(size_t row) const
+    {
+        return bytes.data() + row * stride;
+    }
+
+    void encode(const float *k, float inv_norm, uint8_t *out) const
+    {
+        std::memset(out, 0, stride);
+        if (quantization == KEY_QUANTIZATION_INT8)
+        {
+            float amax = 0.0f;
+            for (int32_t i = 0; i < dim; i++)
+            {
+                amax = std::max(amax, std::fabs(k[i]));
+            }
+            const float scale = amax * inv_norm / 127.0f;
+            const float inv_scale = scale > 0.0f ? inv_norm / scale : 0.0f;
+            for (int32_t i = 0; i < dim; i++)
+            {
+                out[i] = (uint8_t) (int8_t) std::lrint(k[i] * inv_scale);
+            }
+            std::memcpy(out + scale_offset(), &scale, sizeof(scale));
+        }
+        else if (quantization == KEY_QUANTIZATION_BINARY)
+        {
+            for (int32_t i = 0; i < dim; i++)
+            {
+                out[i / 8] |= (k[i] > 0.0f) << (i % 8);
+            }
+        }
+    }
+
+    // estimated cosine between an encoded query and a row
+    float similarity(const uint8_t *q, size_t row) const
+    {
+        const uint8_t *c = code(row);
+        if (quantization == KEY_QUANTIZATION_INT8)
+        {
+            return simd_dot_i8((const int8_t *) q, (const int8_t *) c, dim) * scale(q) * scale(c);
+        }
+        return std::cos(3.14159265f * simd_hamming(q, c, stride) / dim);
+    }
+
+private:
+    size_t scale_offset() const
+    {
+        return (dim + 3) / 4 * 4;
+    }
+
+    float scale(const uint8_t *c) const
+    {
+        float s;
+        std::memcpy(&s, c + scale_offset(), sizeof(s));
+        return s;
+    }
+};
+
+// Hierarchical navigable small world graph over the rows (Malkov & Yashunin): every row is a node
+// of the bottom layer with up to 2 * M links, and of a geometrically decreasing number of upper
+// layers with up to M links. A search descends greedily through the upper layers, then explores the
+// bottom one with a beam of ef candidates: a larger ef trades latency for recall.
+struct hnsw_index
+{
+    typedef std::pair<float, int32_t> candidate; // similarity, node
+
+    int32_t M               = 16;
+    int32_t ef_construction = 200;
+    int32_t ef_search       = 64;
+
+    int32_t max_level = -1;
+    int32_t entry     = -1;
+
+    std::vector<int32_t> levels;
+    std::vector<int32_t> links0;                // per node: the count, then up to 2 * M links
+    std::vector<std::vector<int32_t>> links_up; // per node and upper layer: the count, then up to M links
+
+    std::mt19937 rng{ 42 };
+
+    void clear()
+    {
+        max_level = -1;
+        entry     = -1;
+        levels.clear();
+        links0.clear();
+        links_up.clear();
+    }
+
+    size_t size() const
+    {
+        return levels.size();
+    }
+
+    int32_t max_links(int32_t level) const
+    {
+        return level == 0 ? 2 * M : M;
+    }
+
+    int32_t *links(size_t node, int32_t level)
+    {
+        return level == 0 ? links0.data() + node * (2 * M + 1) : links_up[node].data() + (level - 1) * (M + 1);
+    }
+
+    const int32_t *links(size_t node, int32_t level) const
+    {
+        return const_cast<hnsw_index *>(this)->links(node, level);
+    }
+
+    // rows are added in order, node == row
+    void insert(const vector_rows &rows, size_t node)
+    {
+        const double ml = 1.0 / std::log((double) M);
+        const int32_t level = (int32_t) (-std::log(std::uniform_real_distribution<double>(1e-9, 1.0)(rng)) * ml);
+
+        levels.push_back(level);
+        links0.resize(links0.size() + 2 * M + 1, 0);
+        links_up.emplace_back((size_t) level * (M + 1), 0);
+
+        if (entry < 0)
+        {
+            entry     = node;
+            max_level = level;
+            return;
+        }
+
+        const float *q = rows.key(node);
+        const float q_inv_norm = rows.inv_norm(node);
+
+        candidate ep = { rows.similarity(q, q_inv_norm, entry), entry };
+        for (int32_t l = max_level; l > level; l--)
+        {
+            ep = greedy(rows, q, q_inv_norm, ep, l);
+        }
+
+        std::vector<candidate> found;
+        std::vector<int32_t> selected;
+        for (int32_t l = std::min(level, max_level); l >= 0; l--)
+        {
+            search_layer(rows, q, q_inv_norm, ep, l, ef_construction, [](int32_t) { return false; }, found);
+            select_neighbors(rows, found, M, selected);
+
+            int32_t *own = links(node, l);
+            own[0] = selected.size();
+            std::copy(selected.begin(), selected.end(), own + 1);
+            for (const int32_t other : selected)
+            {
+                add_link(rows, other, node, l);
+            }
+            ep = found.front();
+        }
+
+        if (level > max_level)
+        {
+            max_level = level;
+            entry     = node;
+        }
+    }
+
+    // the k most similar nodes that are not deleted, by decreasing similarity
+    template <typename Deleted>
+    void search(const vector_rows &rows, const float *q, float q_inv_norm, size_t k, const Deleted &deleted,
+                size_t n_deleted, std::vector<candidate> &out) const
+    {
+        out.clear();
+        if (entry < 0)
+        {
+            return;
+        }
+
+        candidate ep = { rows.similarity(q, q_inv_norm, entry), entry };
+        for (int32_t l = max_level; l > 0; l--)
+        {
+            ep = greedy(rows, q, q_inv_norm, ep, l);
+        }
+
+        // the deleted nodes still route the search, the beam is widened by their share
+        const size_t n_live = levels.size() - n_deleted;
+        size_t ef = std::max<size_t>(ef_search, k);
+        if (n_live > 0)
+        {
+            ef = std::min(levels.size(), ef * levels.size() / n_live);
+        }
+        search_layer(rows, q, q_inv_norm, ep, 0, ef, deleted, out);
+        if (out.size() > k)
+        {
+            out.resize(k);
+        }
+    }
+
+    // write the graph to a file, replaced by a rename so that a crash leaves the old one or the new one
+    bool save(const std::string &file, std::string &error) const
+    {
+        const std::string tmp = file + ".tmp";
+        FILE *f = std::fopen(tmp.c_str(), "wb");
+        if (f == NULL)
+        {
+            error = "failed to create " + tmp + ": " + std::strerror(errno);
+            return false;
+        }
+        const graph_header h = { { 'L', 'A', 'I', 'H', 'N', 'S', 'W', '1' }, M, max_level, entry, 0, size() };
+        bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1 &&
+                  std::fwrite(levels.data(), sizeof(int32_t), levels.size(), f) == levels.size() &&
+                  std::fwrite(links0.data(), sizeof(int32_t), links0.size(), f) == links0.size();
+        for (size_t node = 0; ok && node < size(); node++)
+        {
+            ok = links_up[node].empty() || std::fwrite(links_up[node].data(), sizeof(int32_t), links_up[node].size(), f) == links_up[node].size();
+        }
+        ok = std::fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+        std::fclose(f);
+        if (!ok || std::rename(tmp.c_str(), file.c_str()) != 0)
+        {
+            error = "failed to write " + file + ": " + std::strerror(errno);
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // read a graph written by save over at most n_rows rows and with the same M; the graph is
+    // left empty when the file is missing or does not fit
+    bool load(const std::string &file, size_t n_rows)
+    {
+        clear();
+        FILE *f = std::fopen(file.c_str(), "rb");
+        if (f == NULL)
+        {
+            return false;
+        }
+        graph_header h;
+        bool ok = std::fread(&h, sizeof(h), 1, f) == 1 && std::memcmp(h.magic, "LAIHNSW1", 8) == 0 && h.M == M &&
+                  h.n_nodes <= n_rows && h.entry < (int64_t) h.n_nodes && (h.entry >= 0) == (h.n_nodes > 0);
+        if (ok)
+        {
+            levels.resize(h.n_nodes);
+            links0.resize(h.n_nodes * (2 * M + 1));
+            ok = std::fread(levels.data(), sizeof(int32_t), levels.size(), f) == levels.size() &&
+                 std::fread(links0.data(), sizeof(int32_t), links0.size(), f) == links0.size();
+        }
+        for (size_t node = 0; ok && node < h.n_nodes; node++)
+        {
+            ok = levels[node] >= 0 && levels[node] <= h.max_level;
+            if (ok)
+            {
+                links_up.emplace_back((size_t) levels[node] * (M + 1), 0);
+                ok = links_up[node].empty() || std::fread(links_up[node].data(), sizeof(int32_t), links_up[node].size(), f) == links_up[node].size();
+            }
+        }
+        std::fclose(f);
+
+        // a damaged file must not send a search out of the graph: the entry is a node of the top
+        // level, which every greedy descent starts from, and the links stay within their levels
+        ok = ok && (h.n_nodes > 0 ? levels[h.entry] == h.max_level : h.max_level == -1);
+        for (size_t node = 0; ok && node < h.n_nodes; node++)
+        {
+            for (int32_t l = 0; ok && l <= levels[node]; l++)
+            {
+                const int32_t *own = links(node, l);
+                ok = own[0] >= 0 && own[0] <= max_links(l);
+                for (int32_t i = 1; ok && i <= own[0]; i++)
+                {
+                    ok = own[i] >= 0 && (uint64_t) own[i] < h.n_nodes && levels[own[i]] >= l;
+                }
+            }
+        }
+        if (!ok)
+        {
+            clear();
+            return false;
+        }
+        max_level = h.max_level;
+        entry     = h.entry;
+        return true;
+    }
+
+    // drop the nodes whose new_node is -1 and renumber the others: the links of a node to dropped
+    // nodes are replaced by a selection among its other links and the links of the dropped ones,
+    // a repair of O(M^2) similarities per node instead of inserting every node again
+    void compact(const vector_rows &rows, const std::vector<int64_t> &new_node)
+    {
+        const size_t n = size();
+        std::vector<candidate> candidates;
+        std::vector<int32_t> selected;
+        for (size_t node = 0; node < n; node++)
+        {
+            if (new_node[node] < 0)
+            {
+                continue;
+            }
+            for (int32_t l = 0; l <= levels[node]; l++)
+            {
+                int32_t *own = links(node, l);
+                bool dropped = false;
+                for (int32_t i = 1; i <= own[0] && !dropped; i++)
+                {
+                    dropped = new_node[own[i]] < 0;
+                }
+                if (!dropped)
+                {
+                    continue;
+                }
+
+                // the links of dropped nodes are never rewritten, so they can still be read here
+                candidates.clear();
+                const auto add = [&](int32_t other) {
+                    if (other == (int32_t) node || new_node[other] < 0)
+                    {
+                        return;
+                    }
+                    for (const candidate &c : candidates)
+                    {
+                        if (c.second == other)
+                        {
+                            return;
+                        }
+                    }
+                    candidates.push_back({ rows.similarity(node, other), other });
+                };
+                for (int32_t i = 1; i <= own[0]; i++)
+                {
+                    if (new_node[own[i]] >= 0)
+                    {
+                        add(own[i]);
+                        continue;
+                    }
+                    const int32_t *theirs = links(own[i], l);
+                    for (int32_t j = 1; j <= theirs[0]; j++)
+                    {
+                        add(theirs[j]);
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end(), [](const candidate &a, const candidate &b) { return a.first > b.first; });
+                select_neighbors(rows, candidates, max_links(l), selected);
+                own[0] = selected.size();
+                std::copy(selected.begin(), selected.end(), own + 1);
+            }
+        }
+
+        // move the kept nodes down to their new numbers, which never exceed the old ones
+        size_t n_kept = 0;
+        int32_t new_entry = -1;
+        int32_t new_max_level = -1;
+        for (size_t node = 0; node < n; node++)
+        {
+            if (new_node[node] < 0)
+            {
+                continue;
+            }
+            const size_t to = new_node[node];
+            for (int32_t l = 0; l <= levels[node]; l++)
+            {
+                int32_t *own = links(node, l);
+                for (int32_t i = 1; i <= own[0]; i++)
+                {
+                    own[i] = new_node[own[i]];
+                }
+            }
+            if (to != node)
+            {
+                std::copy(links(node, 0), links(node, 0) + 2 * M + 1, links(to, 0));
+                links_up[to].swap(links_up[node]);
+                levels[to] = levels[node];
+            }
+            if (levels[to] > new_max_level)
+            {
+                new_max_level = levels[to];
+                new_entry     = to;
+            }
+            n_kept++;
+        }
+        levels.resize(n_kept);
+        links0.resize(n_kept * (2 * M + 1));
+        links_up.resize(n_kept);
+        // the entry is on the top layer, another node of the highest layer left replaces it
+        entry     = entry >= 0 && new_node[entry] >= 0 ? new_node[entry] : new_entry;
+        max_level = new_max_level;
+    }
+
+private:
+    struct graph_header
+    {
+        char magic[8];
+        int32_t M;
+        int32_t max_level;
+        int32_t entry;
+        int32_t reserved;
+        uint64_t n_nodes;
+    };
+
+    // nodes seen by the current search, marked with a generation number to skip clearing
+    struct visited_set
+    {
+        std::vector<uint32_t> marks;
+        uint32_t generation = 0;
+
+        void reset(size_t n)
+        {
+            if (marks.size() < n)
+            {
+                marks.resize(n, 0);
+            }
+            if (++generation == 0)
+            {
+                std::fill(marks.begin(), marks.end(), 0);
+                generation = 1;
+            }
+        }
+
+        bool insert(int32_t node)
+        {
+            if (marks[node] == generation)
+            {
+                return false;
+            }
+            marks[node] = generation;
+            return true;
+        }
+    };
+
+    candidate greedy(const vector_rows &rows, const float *q, float q_inv_norm, candidate ep, int32_t level) const
+    {
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            const int32_t *l = links(ep.second, level);
+            for (int32_t i = 1; i <= l[0]; i++)
+            {
+                const float sim = rows.similarity(q, q_inv_norm, l[i]);
+                if (sim > ep.first)
+                {
+                    ep = { sim, l[i] };
+                    changed = true;
+                }
+            }
+        }
+        return ep;
+    }
+
+    // beam search of one layer, the best ef nodes by decreasing similarity; the deleted ones are
+    // explored but not returned
+    template <typename Deleted>
+    void search_layer(const vector_rows &rows, const float *q, float q_inv_norm, candidate ep, int32_t level, size_t ef,
+                      const Deleted &deleted, std::vector<candidate> &out) const
+    {
+        static thread_local visited_set visited;
+        visited.reset(levels.size());
+
+        const auto worse  = [](const candidate &a, const candidate &b) { return a.first > b.first; };
+        const auto better = [](const candidate &a, const candidate &b) { return a.first < b.first; };
+
+        std::vector<candidate> frontier; // max-heap
+        out.clear();                     // min-heap of the best ef
+
+        visited.insert(ep.second);
+        frontier.push_back(ep);
+        if (!deleted(ep.second))
+        {
+            out.push_back(ep);
+        }
+        float bar = ep.first;
+
+        while (!frontier.empty())
+        {
+            std::pop_heap(frontier.begin(), frontier.end(), better);
+            const candidate c = frontier.back();
+            frontier.pop_back();
+            if (c.first < bar && out.size() >= ef)
+            {
+                break;
+            }
+
+            const int32_t *l = links(c.second, level);
+            for (int32_t i = 1; i <= l[0]; i++)
+            {
+                const int32_t node = l[i];
+                if (!visited.insert(node))
+                {
+                    continue;
+                }
+                const float sim = rows.similarity(q, q_inv_norm, node);
+                if (out.size() < ef || sim > bar)
+                {
+                    frontier.push_back({ sim, node });
+                    std::push_heap(frontier.begin(), frontier.end(), better);
+
+                    if (!deleted(node))
+                    {
+                        out.push_back({ sim, node });
+                        std::push_heap(out.begin(), out.end(), worse);
+                        if (out.size() > ef)
+                        {
+                            std::pop_heap(out.begin(), out.end(), worse);
+                            out.pop_back();
+                        }
+                    }
+                    if (!out.empty())
+                    {
+                        bar = out.front().first;
+                    }
+                }
+            }
+        }
+
+        std::sort(out.begin(), out.end(), worse);
+    }
+
+    // keep a candidate only if it is more similar to the base than to the neighbours kept so far,
+    // which spreads the links in all directions; candidates are by decreasing similarity
+    void select_neighbors(const vector_rows &rows, const std::vector<candidate> &candidates, int32_t m, std::vector<int32_t> &out) const
+    {
+        out.clear();
+        for (const candidate &c : candidates)
+        {
+            if ((int32_t) out.size() >= m)
+            {
+                break;
+            }
+            bool keep = true;
+            for (const int32_t kept : out)
+            {
+                if (rows.similarity(c.second, kept) > c.first)
+                {
+                    keep = false;
+                    break;
+                }
+            }
+            if (keep)
+            {
+                out.push_back(c.second);
+            }
+        }
+    }
+
+    void add_link(const vector_rows &rows, int32_t node, int32_t other, int32_t level)
+    {
+        int32_t *l = links(node, level);
+        const int32_t n_max = max_links(level);
+        if (l[0] < n_max)
+        {
+            l[++l[0]] = other;
+            return;
+        }
+
+        // full: select again among the current links and the new one
+        std::vector<candidate> candidates;
+        candidates.push_back({ rows.similarity(node, other), other });
+        for (int32_t i = 1; i <= l[0]; i++)
+        {
+            candidates.push_back({ rows.similarity(node, l[i]), l[i] });
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const candidate &a, const candidate &b) { return a.first > b.first; });
+
+        std::vector<int32_t> selected;
+        select_neighbors(rows, candidates, n_max, selected);
+        l[0] = selected.size();
+        std::copy(selected.begin(), selected.end(), l + 1);
+    }
+};
+
+// The store of the Stores* RPCs: the key rows, a heap of the values, and a table with an entry per
+// row pointing into the heap, behind a header with the counts. A hash of the key bytes finds a row,
+// and an optional HNSW index serves the searches.
+//
+// The three buffers are in memory, or for a persistent store mapped from files of a directory:
+// "index" with the header and the table, and "keys.<generation>" and "values.<generation>", with
+// "codes.<generation>" when the keys are quantized, and "graph.<generation>" with the HNSW index. Writes
+// only append, the header last: a new key adds a row and an entry, a new value for a key is added
+// to the heap and its entry pointed at it, and a deleted row is tombstoned in its entry. Once half
+// of the rows or of the heap are garbage, the live rows are compacted into the files of the next
+// generation, committed by renaming a new index over the old one, so that a crash leaves one
+// generation or the other. Opening a store maps the files and hashes the table again, without
+// reading the keys; codes of another quantization are computed again.
+//
+// The rows of an index must stay in place, so with an index deleted rows are also tombstoned in
+// memory; otherwise the last row takes the place of a deleted one. Inserting a row in the graph
+// costs about ef_construction * M similarities, so the graph is not built again on open: it is
+// written by flush once it has grown by a quarter since it was last written, so that opening
+// inserts at most a fifth of the rows, and a compaction repairs the links of the nodes it drops.
+struct vector_store
+{
+    struct match
+    {
+        size_t row;
+        float similarity;
+    };
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        int32_t dim;
+        uint64_t generation;
+        uint64_t n_rows;
+        uint64_t n_deleted;
+        uint64_t heap_size;
+        uint64_t heap_garbage; // bytes of the replaced and deleted values
+        uint32_t quantization; // of the codes file
+        uint32_t reserved;
+    };
+
+    struct entry
+    {
+        uint64_t hash;
+        uint64_t value_offset;
+        uint32_t value_size;
+        uint32_t deleted;
+    };
+
+    static constexpr char magic[8] = { 'L', 'A', 'I', 'S', 'T', 'O', 'R', 'E' };
+    static constexpr uint32_t version = 1;
+
+    std::string path; // directory of a persistent store, empty in memory
+
+    vector_rows rows;
+    key_codes codes;
+    store_buffer heap;
+    store_buffer table;
+    std::unordered_multimap<uint64_t, size_t> rows_by_hash;
+
+    bool use_index = false;
+    hnsw_index index;
+
+    // keys scanned through codes, and the multiple of top_k candidates re-ranked with the float keys (0: none)
+    key_quantization quantization = KEY_QUANTIZATION_NONE;
+    size_t rerank = 4;
+
+    // scans with at least this many floats are split between threads
+    size_t n_parallel_min = 1 << 22;
+
+    // heaps smaller than this are not compacted
+    size_t n_heap_compact_min = 1 << 20;
+
+    mutable std::shared_mutex mutex;
+
+    // nodes of the graph when it was last written
+    size_t n_index_saved = 0;
+
+    vector_store()
+    {
+        std::string error;
+        table.reserve(sizeof(header), error);
+        init_header(*head());
+    }
+
+    ~vector_store()
+    {
+        if (persistent() && use_index && index.size() != n_index_saved)
+        {
+            std::string error;
+            index.save(graph_path(path, head()->generation), error);
+        }
+    }
+
+    bool persistent() const
+    {
+        return !path.empty();
+    }
+
+    int32_t dim() const
+    {
+        return rows.dim;
+    }
+
+    size_t size() const
+    {
+        return head()->n_rows - head()->n_deleted;
+    }
+
+    const float *key(size_t row) const
+    {
+        return rows.key(row);
+    }
+
+    std::string value(size_t row) const
+    {
+        const entry &e = entries()[row];
+        return std::string((const char *) heap.data() + e.value_offset, e.value_size);
+    }
+
+    // open the store of a directory, created if missing
+    bool open(const std::string &dir, std::string &error)
+    {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            error = "failed to create " + dir + ": " + std::strerror(errno);
+            return false;
+        }
+
+        store_buffer t;
+        if (!t.open(dir + "/index", false, error))
+        {
+            return false;
+        }
+        if (t.capacity == 0)
+        {
+            if (!t.reserve(sizeof(header), error))
+            {
+                return false;
+            }
+            init_header(*(header *) t.data());
+        }
+
+        if (t.capacity < sizeof(header) || std::memcmp(((const header *) t.data())->magic, magic, sizeof(magic)) != 0 ||
+            ((const header *) t.data())->version != version)
+        {
+            error = dir + "/index is not a vector store of version " + std::to_string(version);
+            return false;
+        }
+        const header h = *(const header *) t.data();
+
+        store_buffer k;
+        store_buffer v;
+        if (!k.open(key_path(dir, h.generation), false, error) || !v.open(value_path(dir, h.generation), false, error))
+        {
+            return false;
+        }
+
+        vector_rows r;
+        if (h.dim > 0)
+        {
+            r.set_dim(h.dim);
+        }
+        if (t.capacity < sizeof(header) + h.n_rows * sizeof(entry) || k.capacity < h.n_rows * r.row_bytes() || v.capacity < h.heap_size)
+        {
+            error = "truncated vector store in " + dir;
+            return false;
+        }
+
+        path = dir;
+        table.swap(t);
+        rows.keys.swap(k);
+        heap.swap(v);
+        rows.dim    = r.dim;
+        rows.stride = r.stride;
+
+        if (quantization != KEY_QUANTIZATION_NONE)
+        {
+            if (!codes.bytes.open(code_path(dir, h.generation), false, error))
+            {
+                return false;
+            }
+            if (rows.dim > 0)
+            {
+                codes.set_format(quantization, rows.dim);
+                if ((key_quantization) h.quantization != quantization || codes.bytes.capacity < h.n_rows * codes.stride)
+                {
+                    if (!encode_rows(error))
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+        head()->quantization = quantization;
+
+        rehash();
+        index.clear();
+        if (use_index)
+        {
+            // the saved graph, then the rows added since it was written
+            index.load(graph_path(dir, h.generation), h.n_rows);
+            n_index_saved = index.size();
+            for (size_t row = index.size(); row < h.n_rows; row++)
+            {
+                index.insert(rows, row);
+            }
+        }
+        return true;
+    }
+
+    // the keys of a request have the dimension of the store, which takes the one of its first key
+    // whether a key of length n fits the store, any non-empty key fits an empty store
+    bool check_dim(size_t n, std::string &error) const
+    {
+        if (n == 0)
+        {
+            error = "empty key";
+            return false;
+        }
+        if (rows.dim >= 0 && (int32_t) n != rows.dim)
+        {
+            error = "key of length " + std::to_string(n) + " in a store of keys of length " + std::to_string(rows.dim);
+            return false;
+        }
+        return true;
+    }
+
+    // the first key stored fixes the length of the keys, once all the keys of its request were checked
+    void init_dim(size_t n)
+    {
+        if (rows.dim < 0)
+        {
+            rows.set_dim(n);
+            codes.set_format(quantization, n);
+            head()->dim = n;
+        }
+    }
+
+    static uint64_t hash_key(const float *k, size_t n)
+    {
+        // FNV-1a over the bytes of the floats
+        uint64_t h = 14695981039346656037ull;
+        const uint8_t *bytes = (const uint8_t *) k;
+        for (size_t i = 0; i < n * sizeof(float); i++)
+        {
+            h = (h ^ bytes[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    // row of a key, or -1
+    int64_t find_row(const float *k) const
+    {
+        if (rows.dim < 0)
+        {
+            return -1;
+        }
+        const auto range = rows_by_hash.equal_range(hash_key(k, rows.dim));
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (std::memcmp(key(it->second), k, rows.dim * sizeof(float)) == 0)
+            {
+                return it->second;
+            }
+        }
+        return -1;
+    }
+
+    bool set(const float *k, const std::string &value, std::string &error)
+    {
+        uint64_t offset;
+        if (!append_value(value, offset, error))
+        {
+            return false;
+        }
+
+        const int64_t row = find_row(k);
+        if (row >= 0)
+        {
+            entry &e = entries()[row];
+            head()->heap_garbage += e.value_size;
+            e.value_offset = offset;
+            e.value_size   = value.size();
+            return maybe_compact(error);
+        }
+
+        const size_t n = head()->n_rows;
+        if (!rows.keys.reserve((n + 1) * rows.row_bytes(), error) ||
+            !codes.bytes.reserve((n + 1) * codes.stride, error) ||
+            !table.reserve(sizeof(header) + (n + 1) * sizeof(entry), error))
+        {
+            return false;
+        }
+
+        float *r = rows.row(n);
+        std::memcpy(r, k, rows.dim * sizeof(float));
+        r[rows.dim] = vector_rows::compute_inv_norm(k, rows.dim);
+        if (quantization != KEY_QUANTIZATION_NONE)
+        {
+            codes.encode(k, r[rows.dim], codes.code(n));
+        }
+
+        const uint64_t hash = hash_key(k, rows.dim);
+        entries()[n] = { hash, offset, (uint32_t) value.size(), 0 };
+        head()->n_rows = n + 1;
+        rows_by_hash.emplace(hash, n);
+
+        if (use_index)
+        {
+            index.insert(rows, n);
+        }
+        return true;
+    }
+
+    // deleting a missing key is not an error
+    bool remove(const float *k, std::string &error)
+    {
+        const int64_t row = find_row(k);
+        if (row < 0)
+        {
+            return true;
+        }
+
+        erase_hash(row);
+
+        header *h = head();
+        entry *e  = entries();
+        h->heap_garbage += e[row].value_size;
+
+        if (use_index || persistent())
+        {
+            e[row].deleted = 1;
+            h->n_deleted++;
+            return maybe_compact(error);
+        }
+
+        // the last row takes the place of the removed one
+        const size_t last = h->n_rows - 1;
+        if ((size_t) row != last)
+        {
+            erase_hash(last);
+            std::memcpy(rows.row(row), rows.key(last), rows.row_bytes());
+            if (quantization != KEY_QUANTIZATION_NONE)
+            {
+                std::memcpy(codes.code(row), codes.code(last), codes.stride);
+            }
+            e[row] = e[last];
+            rows_by_hash.emplace(e[row].hash, row);
+        }
+        h->n_rows = last;
+        return maybe_compact(error);
+    }
+
+    // schedule the write back of a persistent store, and write its graph once it has grown by a
+    // quarter; a graph that failed to be written is only a cost for the next open
+    void flush()
+    {
+        rows.keys.flush(false);
+        codes.bytes.flush(false);
+        heap.flush(false);
+        table.flush(false);
+        if (persistent() && use_index && index.size() > n_index_saved + n_index_saved / 4)
+        {
+            std::string error;
+            if (index.save(graph_path(path, head()->generation), error))
+            {
+                n_index_saved = index.size();
+            }
+        }
+    }
+
+    // the top_k rows most similar to q, by decreasing similarity
+    void find(const float *q, size_t top_k, std::vector<match> &out) const
+    {
+        out.clear();
+        top_k = std::min(top_k, size());
+        if (top_k == 0)
+        {
+            return;
+        }
+
+        const float q_inv_norm = vector_rows::compute_inv_norm(q, rows.dim);
+
+        if (use_index)
+        {
+            const entry *e = entries();
+            std::vector<hnsw_index::candidate> found;
+            index.search(rows, q, q_inv_norm, top_k, [e](int32_t node) { return e[node].deleted != 0; }, head()->n_deleted, found);
+            for (const hnsw_index::candidate &c : found)
+            {
+                out.push_back({ (size_t) c.second, c.first });
+            }
+            return;
+        }
+
+        if (quantization == KEY_QUANTIZATION_NONE)
+        {
+            select(top_k, [&](size_t row) { return rows.similarity(q, q_inv_norm, row); }, out);
+            return;
+        }
+
+        // the best candidates by their codes, then by their float keys
+        std::vector<uint8_t> q_code(codes.stride);
+        codes.encode(q, q_inv_norm, q_code.data());
+        select(rerank > 0 ? std::min(top_k * rerank, size()) : top_k, [&](size_t row) { return codes.similarity(q_code.data(), row); }, out);
+        if (rerank > 0)
+        {
+            for (match &m : out)
+            {
+                m.similarity = rows.similarity(q, q_inv_norm, m.row);
+            }
+            sort_matches(out);
+            out.resize(top_k);
+        }
+    }
+
+private:
+    static void init_header(header &h)
+    {
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.dim     = -1;
+    }
+
+    static std::string key_path(const std::string &dir, uint64_t generation)
+    {
+        return dir + "/keys." + std::to_string(generation);
+    }
+
+    static std::string value_path(const std::string &dir, uint64_t generation)
+    {
+        return dir + "/values." + std::to_string(generation);
+    }
+
+    static std::string code_path(const std::string &dir, uint64_t generation)
+    {
+        return dir + "/codes." + std::to_string(generation);
+    }
+
+    static std::string graph_path(const std::string &dir, uint64_t generation)
+    {
+        return dir + "/graph." + std::to_string(generation);
+    }
+
+    // codes of all the rows, after a change of quantization
+    bool encode_rows(std::string &error)
+    {
+        const size_t n = head()->n_rows;
+        if (!codes.bytes.reserve(std::max<size_t>(n * codes.stride, 1), error))
+        {
+            return false;
+        }
+        for (size_t row = 0; row < n; row++)
+        {
+            codes.encode(rows.key(row), rows.inv_norm(row), codes.code(row));
+        }
+        codes.bytes.flush(true);
+        return true;
+    }
+
+    header *head()
+    {
+        return (header *) table.data();
+    }
+
+    const header *head() const
+    {
+        return (const header *) table.data();
+    }
+
+    entry *entries()
+    {
+        return (entry *) (table.data() + sizeof(header));
+    }
+
+    const entry *entries() const
+    {
+        return (const entry *) (table.data() + sizeof(header));
+    }
+
+    bool append_value(const std::string &value, uint64_t &offset, std::string &error)
+    {
+        offset = head()->heap_size;
+        if (!heap.reserve(offset + value.size(), error))
+        {
+            return false;
+        }
+        std::memcpy(heap.data() + offset, value.data(), value.size());
+        head()->heap_size = offset + value.size();
+        return true;
+    }
+
+    void erase_hash(size_t row)
+    {
+        const auto range = rows_by_hash.equal_range(entries()[row].hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == row)
+            {
+                rows_by_hash.erase(it);
+                return;
+            }
+        }
+    }
+
+    // hash the live rows
+    void rehash()
+    {
+        const size_t n = head()->n_rows;
+        const entry *e = entries();
+
+        rows_by_hash.clear();
+        rows_by_hash.reserve(n);
+        for (size_t row = 0; row < n; row++)
+        {
+            if (!e[row].deleted)
+            {
+                rows_by_hash.emplace(e[row].hash, row);
+            }
+        }
+    }
+
+    bool maybe_compact(std::string &error)
+    {
+        const header *h = head();
+        if (h->n_deleted * 2 > h->n_rows || (h->heap_garbage * 2 > h->heap_size && h->heap_size >= n_heap_compact_min))
+        {
+            return compact(error);
+        }
+        return true;
+    }
+
+    // copy the live rows and values into new buffers, or the files of the next generation
+    bool compact(std::string &error)
+    {
+        const header h = *head();
+        const size_t n_live = h.n_rows - h.n_deleted;
+        const uint64_t generation = h.generation + 1;
+
+        const bool quantized = quantization != KEY_QUANTIZATION_NONE;
+
+        store_buffer k;
+        store_buffer c;
+        store_buffer v;
+        store_buffer t;
+        if (persistent() && (!k.open(key_path(path, generation), true, error) || !v.open(value_path(path, generation), true, error) ||
+                             (quantized && !c.open(code_path(path, generation), true, error)) ||
+                             !t.open(path + "/index.tmp", true, error)))
+        {
+            return false;
+        }
+        if (!k.reserve(std::max<size_t>(n_live * rows.row_bytes(), 1), error) ||
+            (quantized && !c.reserve(std::max<size_t>(n_live * codes.stride, 1), error)) ||
+            !v.reserve(std::max<size_t>(h.heap_size - h.heap_garbage, 1), error) ||
+            !t.reserve(sizeof(header) + n_live * sizeof(entry), error))
+        {
+            return false;
+        }
+
+        const entry *e = entries();
+        entry *new_entries = (entry *) (t.data() + sizeof(header));
+        std::vector<int64_t> new_row(h.n_rows, -1);
+        size_t n = 0;
+        uint64_t heap_size = 0;
+        for (size_t row = 0; row < h.n_rows; row++)
+        {
+            if (e[row].deleted)
+            {
+                continue;
+            }
+            new_row[row] = n;
+            std::memcpy(k.data() + n * rows.row_bytes(), rows.key(row), rows.row_bytes());
+            if (quantized)
+            {
+                std::memcpy(c.data() + n * codes.stride, codes.code(row), codes.stride);
+            }
+            std::memcpy(v.data() + heap_size, heap.data() + e[row].value_offset, e[row].value_size);
+            new_entries[n] = { e[row].hash, heap_size, e[row].value_size, 0 };
+            heap_size += e[row].value_size;
+            n++;
+        }
+
+        header &new_head = *(header *) t.data();
+        new_head              = h;
+        new_head.generation   = generation;
+        new_head.n_rows       = n;
+        new_head.n_deleted    = 0;
+        new_head.heap_size    = heap_size;
+        new_head.heap_garbage = 0;
+
+        if (persistent())
+        {
+            k.flush(true);
+            c.flush(true);
+            v.flush(true);
+            t.flush(true);
+            if (std::rename((path + "/index.tmp").c_str(), (path + "/index").c_str()) != 0)
+            {
+                error = "failed to replace " + path + "/index: " + std::strerror(errno);
+                return false;
+            }
+            std::remove(key_path(path, h.generation).c_str());
+            std::remove(value_path(path, h.generation).c_str());
+            std::remove(code_path(path, h.generation).c_str());
+            std::remove(graph_path(path, h.generation).c_str());
+        }
+
+        // the graph is repaired over the old rows, before they are replaced
+        if (use_index)
+        {
+            index.compact(rows, new_row);
+        }
+        rows.keys.swap(k);
+        codes.bytes.swap(c);
+        heap.swap(v);
+        table.swap(t);
+        rehash();
+
+        n_index_saved = 0;
+        if (persistent() && use_index)
+        {
+            std::string graph_error;
+            if (index.save(graph_path(path, generation), graph_error))
+            {
+                n_index_saved = index.size();
+            }
+        }
+        return true;
+    }
+
+    static void sort_matches(std::vector<match> &matches)
+    {
+        std::sort(matches.begin(), matches.end(), [](const match &a, const match &b) {
+            return a.similarity > b.similarity || (a.similarity == b.similarity && a.row < b.row);
+        });
+    }
+
+    // the top_k live rows by decreasing score, scanned by several threads for large stores
+    template <typename Score>
+    void select(size_t top_k, const Score &score, std::vector<match> &out) const
+    {
+        const size_t n = head()->n_rows;
+        size_t n_threads = 1;
+        if (n * rows.dim >= n_parallel_min)
+        {
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+            n_threads = std::min(n_threads, n / top_k);
+            n_threads = std::max<size_t>(n_threads, 1);
+        }
+
+        if (n_threads == 1)
+        {
+            scan(score, 0, n, top_k, out);
+        }
+        else
+        {
+            // each thread selects the best rows of a range, the selections are merged
+            std::vector<std::vector<match>> partial(n_threads);
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < n_threads; t++)
+            {
+                threads.emplace_back([&, t]() {
+                    scan(score, n * t / n_threads, n * (t + 1) / n_threads, top_k, partial[t]);
+                });
+            }
+            for (std::thread &thread : threads)
+            {
+                thread.join();
+            }
+            for (const std::vector<match> &p : partial)
+            {
+                out.insert(out.end(), p.begin(), p.end());
+            }
+        }
+
+        sort_matches(out);
+        out.resize(std::min(out.size(), top_k));
+    }
+
+    // top_k selection over the live rows of [begin, end) with a min-heap on the score, unordered
+    template <typename Score>
+    void scan(const Score &score, size_t begin, size_t end, size_t top_k, std::vector<match> &out) const
+    {
+        const auto worse = [](const match &a, const match &b) { return a.similarity > b.similarity; };
+        const entry *e = entries();
+
+        out.clear();
+        out.reserve(top_k);
+        for (size_t row = begin; row < end; row++)
+        {
+            if (e[row].deleted)
+            {
+                continue;
+            }
+            const float similarity = score(row);
+            if (out.size() < top_k)
+            {
+                out.push_back({ row, similarity });
+                std::push_heap(out.begin(), out.end(), worse);
+            }
+            else if (similarity > out.front().similarity)
+            {
+                std::pop_heap(out.begin(), out.end(), worse);
+                out.back() = { row, similarity };
+                std::push_heap(out.begin(), out.end(), worse);
+            }
+        }
+    }
+};
@@ -0,0 +1,117 @@
+// Checks the nodes of llama_grammar_trie over a vocabulary with multi-byte UTF-8 pieces: every node
+// must hold a contiguous range of tokens that share its prefix, and every token must be reached once.
+//
+// usage: test-grammar-trie
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "grammar-trie.hpp"
+
+static int n_failed = 0;
+
+#define CHECK(cond, ...)                              \
+    do                                                \
+    {                                                 \
+        if (!(cond))                                  \
+        {                                             \
+            fprintf(stderr, "FAILED %s: ", #cond);    \
+            fprintf(stderr, __VA_ARGS__);             \
+            fprintf(stderr, "\n");                    \
+            n_failed++;                               \
+        }                                             \
+    } while (0)
+
+static void set_pieces(llama_vocab_pieces &pieces, const std::vector<std::string> &vocab)
+{
+    pieces.arena.clear();
+    pieces.offsets.assign(vocab.size() + 1, 0);
+    for (size_t tok = 0; tok < vocab.size(); tok++)
+    {
+        pieces.offsets[tok] = pieces.arena.size();
+        pieces.arena += vocab[tok];
+    }
+    pieces.offsets[vocab.size()] = pieces.arena.size();
+}
+
+// walks the nodes as mask() does, checking each one; returns the tokens reached
+static size_t walk(llama_grammar_trie &trie, int32_t begin, int32_t end, int32_t depth, const std::string &prefix)
+{
+    size_t n_reached = 0;
+    for (int32_t i = begin; i < end; i++)
+    {
+        const std::string_view piece = trie.pieces->get(trie.sorted[i]);
+        CHECK(piece.size() >= (size_t) depth && piece.substr(0, depth) == prefix,
+              "token %d \"%.*s\" in the node of prefix \"%s\"", trie.sorted[i], (int) piece.size(), piece.data(), prefix.c_str());
+    }
+    if (trie.pieces->get(trie.sorted[begin]).size() == (size_t) depth)
+    {
+        n_reached++;
+        begin++;
+    }
+
+    trie.next.clear();
+    trie.push_children(begin, end, depth);
+    const std::vector<llama_grammar_trie::node> children = trie.next;
+
+    int32_t expected_begin = begin;
+    for (const llama_grammar_trie::node &child : children)
+    {
+        CHECK(child.begin == expected_begin && child.begin < child.end && child.depth == depth + 1,
+              "child [%d, %d) of prefix \"%s\" after %d", child.begin, child.end, prefix.c_str(), expected_begin);
+        expected_begin = child.end;
+        if (child.begin >= child.end || child.depth != depth + 1)
+        {
+            continue;
+        }
+        const std::string_view first = trie.pieces->get(trie.sorted[child.begin]);
+        if (first.size() <= (size_t) depth)
+        {
+            continue;
+        }
+        n_reached += walk(trie, child.begin, child.end, child.depth, prefix + first[depth]);
+    }
+    CHECK(expected_begin == end, "children of prefix \"%s\" end at %d instead of %d", prefix.c_str(), expected_begin, end);
+    return n_reached;
+}
+
+int main()
+{
+    // ASCII around the UTF-8 lead bytes 0xc3 (è, é), a 4-byte character, a lone continuation byte
+    // and the byte 0xff, so that groups on both sides of 0x80 sit next to each other
+    const std::vector<std::string> vocab = {
+        "", "A", "B", "C", "BC", "\xc3\xa8x", "\xc3\xa9", "\xc3\xa8", "\xc3", "\x80", "\xff", "z", "zz",
+        "\xf0\x9f\x98\x80", "\xf0\x9f", "a\xc3\xa9", "a", "ab", "{\"", "\"", "\xc3\xa9t\xc3\xa9", "\x7f",
+    };
+
+    llama_vocab_pieces pieces;
+    set_pieces(pieces, vocab);
+
+    llama_grammar_trie trie;
+    trie.init(pieces, vocab.size());
+    CHECK(trie.empty_pieces.size() == 1, "%zu empty pieces", trie.empty_pieces.size());
+    CHECK(trie.sorted.size() == vocab.size() - 1, "%zu sorted tokens", trie.sorted.size());
+
+    const size_t n_reached = walk(trie, 0, trie.sorted.size(), 0, "");
+    CHECK(n_reached == trie.sorted.size(), "%zu tokens reached of %zu", n_reached, trie.sorted.size());
+
+    // the groups of the first byte are the distinct first bytes, in unsigned order
+    trie.next.clear();
+    trie.push_children(0, trie.sorted.size(), 0);
+    std::vector<unsigned char> first_bytes;
+    for (const llama_grammar_trie::node &n : trie.next)
+    {
+        first_bytes.push_back(pieces.get(trie.sorted[n.begin])[0]);
+    }
+    const std::vector<unsigned char> expected = { '"', 'A', 'B', 'C', 'a', 'z', '{', 0x7f, 0x80, 0xc3, 0xf0, 0xff };
+    CHECK(first_bytes == expected, "%zu first-byte groups instead of %zu", first_bytes.size(), expected.size());
+
+    if (n_failed > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", n_failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
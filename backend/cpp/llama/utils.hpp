@@ -2,15 +2,28 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 #include <set>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "json.hpp"
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "../llava/clip.h"
 
 using json = nlohmann::json;
@@ -90,6 +103,13 @@ enum slot_command
     NONE,
     LOAD_PROMPT,
     RELEASE,
+    FORK, // waiting for the KV cells of the slot that evaluates the shared prompt
+};
+
+struct stop_token_sequence
+{
+    std::vector<llama_token> tokens;
+    std::string word; // reported as the stopping word
 };
 
 struct slot_params
@@ -100,8 +120,10 @@ struct slot_params
     uint32_t seed      = -1; // RNG seed
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_predict = -1; // new tokens to predict
+    int32_t  priority  =  0; // higher priority sequences may preempt lower ones when the KV cache is full
 
     std::vector<std::string> antiprompt;
+    std::vector<stop_token_sequence> stop_tokens; // checked on the token ids, before detokenization
 
     json input_prefix;
     json input_suffix;
@@ -131,9 +153,433 @@ struct completion_token_output
 
     std::vector<token_prob> probs;
     llama_token tok;
+    float prob = 0.0f; // of tok, which the sampling may have drawn from outside probs
     std::string text_to_send;
 };
 
+// tracks whether the bytes fed so far end inside a UTF-8 multibyte character
+struct utf8_decoder
+{
+    uint8_t n_pending = 0; // continuation bytes still expected
+
+    void reset()
+    {
+        n_pending = 0;
+    }
+
+    void feed(const char *text, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            const uint8_t c = text[i];
+            if ((c & 0xC0) == 0x80)
+            {
+                // continuation byte: 10xxxxxx
+                n_pending = n_pending > 0 ? n_pending - 1 : 0;
+            }
+            else if ((c & 0xE0) == 0xC0)
+            {
+                n_pending = 1; // 110xxxxx
+            }
+            else if ((c & 0xF0) == 0xE0)
+            {
+                n_pending = 2; // 1110xxxx
+            }
+            else if ((c & 0xF8) == 0xF0)
+            {
+                n_pending = 3; // 11110xxx
+            }
+            else
+            {
+                n_pending = 0; // 1-byte character or invalid byte
+            }
+        }
+    }
+
+    bool complete() const
+    {
+        return n_pending == 0;
+    }
+};
+
+// Aho-Corasick automaton over the stop strings of a slot, compiled to a dense DFA over the byte classes
+// that occur in them. The generated text is fed as it arrives, matching allocates nothing.
+struct stop_string_matcher
+{
+    int32_t n_classes = 1;
+    uint8_t byte_class[256] = {};  // 0 for the bytes that are in no stop string
+
+    std::vector<int32_t> next;       // n_states * n_classes transitions
+    std::vector<int32_t> depth;      // length of the stop string prefix of each state
+    std::vector<int32_t> match_len;  // longest stop string ending at each state, 0 if none
+    std::vector<int32_t> match_word;
+
+    int32_t state = 0;
+    size_t  n_fed = 0;
+
+    size_t  match_pos  = std::string::npos; // earliest start of a complete stop string
+    int32_t match_idx  = -1;
+
+    void build(const std::vector<std::string> &words)
+    {
+        std::fill(std::begin(byte_class), std::end(byte_class), 0);
+        n_classes = 1;
+        for (const std::string &word : words)
+        {
+            for (const char c : word)
+            {
+                uint8_t &cls = byte_class[(uint8_t) c];
+                if (cls == 0)
+                {
+                    cls = n_classes++;
+                }
+            }
+        }
+
+        next.assign(n_classes, -1);
+        depth.assign(1, 0);
+        match_len.assign(1, 0);
+        match_word.assign(1, -1);
+
+        // trie of the stop strings
+        for (size_t k = 0; k < words.size(); k++)
+        {
+            int32_t s = 0;
+            for (const char c : words[k])
+            {
+                const size_t i = s * n_classes + byte_class[(uint8_t) c];
+                if (next[i] < 0)
+                {
+                    next[i] = depth.size();
+                    next.resize(next.size() + n_classes, -1);
+                    depth.push_back(depth[s] + 1);
+                    match_len.push_back(0);
+                    match_word.push_back(-1);
+                }
+                s = next[i];
+            }
+            if (s != 0 && match_len[s] == 0)
+            {
+                match_len[s]  = words[k].size();
+                match_word[s] = k;
+            }
+        }
+
+        // breadth-first: resolve the missing transitions through the failure links
+        std::vector<int32_t> fail(depth.size(), 0);
+        std::vector<int32_t> queue;
+        queue.reserve(depth.size());
+        for (int32_t c = 0; c < n_classes; c++)
+        {
+            if (next[c] < 0)
+            {
+                next[c] = 0;
+            }
+            else
+            {
+                queue.push_back(next[c]);
+            }
+        }
+        for (size_t q = 0; q < queue.size(); q++)
+        {
+            const int32_t s = queue[q];
+            if (match_len[s] == 0)
+            {
+                match_len[s]  = match_len[fail[s]];
+                match_word[s] = match_word[fail[s]];
+            }
+            for (int32_t c = 0; c < n_classes; c++)
+            {
+                int32_t &t = next[s * n_classes + c];
+                const int32_t t_fail = next[fail[s] * n_classes + c];
+                if (t < 0)
+                {
+                    t = t_fail;
+                }
+                else
+                {
+                    fail[t] = t_fail;
+                    queue.push_back(t);
+                }
+            }
+        }
+
+        state     = 0;
+        n_fed     = 0;
+        match_pos = std::string::npos;
+        match_idx = -1;
+    }
+
+    void feed(const char *text, size_t n)
+    {
+        if (depth.size() > 1)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                state = next[state * n_classes + byte_class[(uint8_t) text[i]]];
+                if (match_len[state] > 0)
+                {
+                    const size_t pos = n_fed + i + 1 - match_len[state];
+                    if (pos < match_pos)
+                    {
+                        match_pos = pos;
+                        match_idx = match_word[state];
+                    }
+                }
+            }
+        }
+        n_fed += n;
+    }
+
+    // start of the longest stop string prefix that ends the text, npos if none
+    size_t partial_pos() const
+    {
+        return depth[state] > 0 ? n_fed - depth[state] : std::string::npos;
+    }
+};
+
+// the tokens generated by a slot with their top probabilities, in flat buffers so that a slot
+// reuses their capacity from one request to the next instead of allocating per token
+struct completion_token_probs
+{
+    std::vector<llama_token> tokens;
+    std::vector<float> token_probs; // of the tokens themselves
+    std::vector<completion_token_output::token_prob> probs;
+    std::vector<uint32_t> offsets = {0}; // probs of token i are [offsets[i], offsets[i + 1])
+
+    size_t size() const
+    {
+        return tokens.size();
+    }
+
+    void clear()
+    {
+        tokens.clear();
+        token_probs.clear();
+        probs.clear();
+        offsets.assign(1, 0);
+    }
+
+    void reserve(size_t n_tokens, size_t n_probs)
+    {
+        tokens.reserve(n_tokens);
+        token_probs.reserve(n_tokens);
+        probs.reserve(n_tokens * n_probs);
+        offsets.reserve(n_tokens + 1);
+    }
+
+    void push_back(const completion_token_output &token)
+    {
+        tokens.push_back(token.tok);
+        token_probs.push_back(token.prob);
+        probs.insert(probs.end(), token.probs.begin(), token.probs.end());
+        offsets.push_back(probs.size());
+    }
+
+    // tokens [begin, end) for the responses
+    std::vector<completion_token_output> slice(size_t begin, size_t end) const
+    {
+        end = std::min(end, size());
+        std::vector<completion_token_output> out;
+        for (size_t i = begin; i < end; i++)
+        {
+            completion_token_output token;
+            token.tok = tokens[i];
+            token.prob = token_probs[i];
+            token.probs.assign(probs.begin() + offsets[i], probs.begin() + offsets[i + 1]);
+            out.push_back(std::move(token));
+        }
+        return out;
+    }
+};
+
+static inline float simd_max(const float *x, size_t n)
+{
+    float m = -INFINITY;
+    size_t i = 0;
+#if defined(__AVX__)
+    if (n >= 8)
+    {
+        __m256 vm = _mm256_loadu_ps(x);
+        for (i = 8; i + 8 <= n; i += 8)
+        {
+            vm = _mm256_max_ps(vm, _mm256_loadu_ps(x + i));
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, vm);
+        m = *std::max_element(lanes, lanes + 8);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (n >= 4)
+    {
+        float32x4_t vm = vld1q_f32(x);
+        for (i = 4; i + 4 <= n; i += 4)
+        {
+            vm = vmaxq_f32(vm, vld1q_f32(x + i));
+        }
+        m = vmaxvq_f32(vm);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        m = std::max(m, x[i]);
+    }
+    return m;
+}
+
+// sum of exp(x[i] - shift) over x[i] <= shift, with a Cephes-style polynomial exp in the vector lanes
+// (relative error around 1e-7, the terms below e^-87 are clamped to it instead of flushed to zero)
+static inline float simd_sum_exp(const float *x, size_t n, float shift)
+{
+    float sum = 0.0f;
+    size_t i = 0;
+#if defined(__AVX2__)
+    if (n >= 8)
+    {
+        const __m256 vshift = _mm256_set1_ps(shift);
+        const __m256 vmin = _mm256_set1_ps(-87.3f);
+        const __m256 log2e = _mm256_set1_ps(1.44269504f);
+        const __m256 half = _mm256_set1_ps(0.5f);
+        const __m256 c1 = _mm256_set1_ps(0.693359375f);
+        const __m256 c2 = _mm256_set1_ps(-2.12194440e-4f);
+        const __m256 one = _mm256_set1_ps(1.0f);
+        __m256 vsum = _mm256_setzero_ps();
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 v = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vshift), vmin);
+            const __m256 k = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(v, log2e), half));
+            v = _mm256_sub_ps(_mm256_sub_ps(v, _mm256_mul_ps(k, c1)), _mm256_mul_ps(k, c2));
+            __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+            p = _mm256_add_ps(_mm256_mul_ps(p, v), _mm256_set1_ps(1.3981999507e-3f));
+            p = _mm256_add_ps(_mm256_mul_ps(p, v), _mm256_set1_ps(8.3334519073e-3f));
+            p = _mm256_add_ps(_mm256_mul_ps(p, v), _mm256_set1_ps(4.1665795894e-2f));
+            p = _mm256_add_ps(_mm256_mul_ps(p, v), _mm256_set1_ps(1.6666665459e-1f));
+            p = _mm256_add_ps(_mm256_mul_ps(p, v), half);
+            p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, v), v), v), one);
+            const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+            vsum = _mm256_add_ps(vsum, _mm256_mul_ps(p, _mm256_castsi256_ps(e)));
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, vsum);
+        for (float lane : lanes)
+        {
+            sum += lane;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (n >= 4)
+    {
+        const float32x4_t vshift = vdupq_n_f32(shift);
+        const float32x4_t vmin = vdupq_n_f32(-87.3f);
+        const float32x4_t c1 = vdupq_n_f32(0.693359375f);
+        const float32x4_t c2 = vdupq_n_f32(-2.12194440e-4f);
+        float32x4_t vsum = vdupq_n_f32(0.0f);
+        for (; i + 4 <= n; i += 4)
+        {
+            float32x4_t v = vmaxq_f32(vsubq_f32(vld1q_f32(x + i), vshift), vmin);
+            const int32x4_t k = vcvtnq_s32_f32(vmulq_n_f32(v, 1.44269504f));
+            const float32x4_t kf = vcvtq_f32_s32(k);
+            v = vsubq_f32(vsubq_f32(v, vmulq_f32(kf, c1)), vmulq_f32(kf, c2));
+            float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+            p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), p, v);
+            p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, v);
+            p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, v);
+            p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, v);
+            p = vfmaq_f32(vdupq_n_f32(0.5f), p, v);
+            p = vaddq_f32(vfmaq_f32(v, vmulq_f32(p, v), v), vdupq_n_f32(1.0f));
+            const int32x4_t e = vshlq_n_s32(vaddq_s32(k, vdupq_n_s32(127)), 23);
+            vsum = vfmaq_f32(vsum, p, vreinterpretq_f32_s32(e));
+        }
+        sum = vaddvq_f32(vsum);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        sum += expf(x[i] - shift);
+    }
+    return sum;
+}
+
+// top-n probabilities of a candidate array without sorting it: max and log-sum-exp over a contiguous
+// copy of the logits, and a bounded insertion selection of the n largest
+struct logprobs_engine
+{
+    std::vector<float> logits;
+    float log_sum = 0.0f; // of the exponentials of the logits of the last selection
+
+    // probability of the i-th logit of the last selection
+    float prob(size_t i) const
+    {
+        return expf(logits[i] - log_sum);
+    }
+
+    void top_n(const llama_token_data_array &cur, size_t n, std::vector<completion_token_output::token_prob> &out)
+    {
+        logits.resize(cur.size);
+        for (size_t i = 0; i < cur.size; i++)
+        {
+            logits[i] = cur.data[i].logit;
+        }
+        select(n, out, [&cur](size_t i) { return cur.data[i].id; });
+    }
+
+    // same, over the logits of the whole vocabulary
+    void top_n(const float *logits_vocab, size_t n_vocab, size_t n, std::vector<completion_token_output::token_prob> &out)
+    {
+        logits.assign(logits_vocab, logits_vocab + n_vocab);
+        select(n, out, [](size_t i) { return (llama_token) i; });
+    }
+
+    // same, after adjust(logits) changed the copy of the logits
+    template <class Adjust>
+    void top_n(const float *logits_vocab, size_t n_vocab, size_t n, std::vector<completion_token_output::token_prob> &out, const Adjust &adjust)
+    {
+        logits.assign(logits_vocab, logits_vocab + n_vocab);
+        adjust(logits);
+        select(n, out, [](size_t i) { return (llama_token) i; });
+    }
+
+private:
+    template <class Id>
+    void select(size_t n, std::vector<completion_token_output::token_prob> &out, const Id &id)
+    {
+        out.clear();
+        n = std::min(n, logits.size());
+        if (n == 0)
+        {
+            return;
+        }
+
+        const float max = simd_max(logits.data(), logits.size());
+        log_sum = max + logf(simd_sum_exp(logits.data(), logits.size(), max));
+
+        // out holds the n best so far in decreasing order, its last logit is the bar to enter
+        for (size_t i = 0; i < logits.size(); i++)
+        {
+            const float logit = logits[i];
+            if (out.size() == n && logit <= out.back().prob)
+            {
+                continue;
+            }
+            if (out.size() < n)
+            {
+                out.push_back({});
+            }
+            size_t j = out.size() - 1;
+            for (; j > 0 && out[j - 1].prob < logit; j--)
+            {
+                out[j] = out[j - 1];
+            }
+            out[j] = { id(i), logit };
+        }
+
+        for (auto &p : out)
+        {
+            p.prob = expf(p.prob - log_sum);
+        }
+    }
+};
+
 static inline void server_log(const char *level, const char *function, int line,
                        const char *message, const nlohmann::ordered_json &extra)
 {
@@ -189,6 +635,96 @@ inline std::string format_chatml(std::vector<json> messages)
 // work queue utils
 //
 
+// a fixed set of threads that run the iterations of a loop together with the calling thread,
+// run() returns once every iteration is done
+struct llama_worker_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable condition_start;
+    std::condition_variable condition_done;
+
+    const std::function<void(size_t)> *job = nullptr;
+    size_t n_jobs = 0;
+    std::atomic<size_t> i_next{0};
+
+    size_t   n_pending  = 0;
+    uint64_t generation = 0;
+    bool     stop       = false;
+
+    void start(int32_t n_threads) {
+        for (int32_t i = 0; i < n_threads; i++)
+        {
+            threads.emplace_back([this]() {
+                uint64_t seen = 0;
+                while (true)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        condition_start.wait(lock, [&]{ return stop || generation != seen; });
+                        if (stop)
+                        {
+                            return;
+                        }
+                        seen = generation;
+                    }
+                    work();
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        if (--n_pending == 0)
+                        {
+                            condition_done.notify_one();
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    ~llama_worker_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        condition_start.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    size_t size() const {
+        return threads.size();
+    }
+
+    void run(size_t n, const std::function<void(size_t)> &fn) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job       = &fn;
+            n_jobs    = n;
+            i_next    = 0;
+            n_pending = threads.size();
+            generation++;
+        }
+        condition_start.notify_all();
+
+        work();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        condition_done.wait(lock, [&]{ return n_pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    void work() {
+        size_t i;
+        while ((i = i_next.fetch_add(1)) < n_jobs)
+        {
+            (*job)(i);
+        }
+    }
+};
+
 struct llama_server_queue {
     int id = 0;
     std::mutex mutex_tasks;
@@ -213,12 +749,39 @@ struct llama_server_queue {
         return task.id;
     }
 
+    // Add several tasks at once, the main loop sees all of them in its next pass
+    void post(std::vector<task_server> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+    }
+
     // Add a new task, but defer until one slot is available
     void defer(task_server task) {
         std::unique_lock<std::mutex> lock(mutex_tasks);
         queue_tasks_deferred.push_back(std::move(task));
     }
 
+    // Drop the waiting tasks of these ids, in the queue or deferred, with the multitasks of these ids
+    // and their subtasks; the ones already taken by the main loop are cancelled by a TASK_TYPE_CANCEL task
+    void erase(const std::unordered_set<int> & task_ids) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const auto cancelled = [&](const task_server & task) {
+            return task.type == TASK_TYPE_COMPLETION && (task_ids.count(task.id) != 0 || task_ids.count(task.multitask_id) != 0);
+        };
+        queue_tasks.erase(std::remove_if(queue_tasks.begin(), queue_tasks.end(), cancelled), queue_tasks.end());
+        queue_tasks_deferred.erase(std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), cancelled), queue_tasks_deferred.end());
+        // the cancelled subtasks never finish, their multitask would wait forever
+        queue_multitasks.erase(std::remove_if(queue_multitasks.begin(), queue_multitasks.end(),
+                                              [&](const task_multi & multitask) { return task_ids.count(multitask.id) != 0; }),
+                               queue_multitasks.end());
+    }
+
     // Get the next id for creating anew task
     int get_new_id() {
         std::unique_lock<std::mutex> lock(mutex_tasks);
@@ -271,23 +834,30 @@ struct llama_server_queue {
                     callback_new_task(task);
                 }
                 LOG_VERBOSE("callback_all_task_finished", {});
-                // process and update all the multitasks
-                auto queue_iterator = queue_multitasks.begin();
-                while (queue_iterator != queue_multitasks.end())
+                // process and update all the multitasks, subtasks are added and updated from other
+                // threads so the finished ones are taken out under the lock and reported after it
+                std::vector<task_multi> finished_multitasks;
                 {
-                    if (queue_iterator->subtasks_remaining.empty())
-                    {
-                        // all subtasks done == multitask is done
-                        task_multi current_multitask = *queue_iterator;
-                        callback_finish_multitask(current_multitask);
-                        // remove this multitask
-                        queue_iterator = queue_multitasks.erase(queue_iterator);
-                    }
-                    else
+                    std::unique_lock<std::mutex> lock(mutex_tasks);
+                    auto queue_iterator = queue_multitasks.begin();
+                    while (queue_iterator != queue_multitasks.end())
                     {
-                        ++queue_iterator;
+                        if (queue_iterator->subtasks_remaining.empty())
+                        {
+                            // all subtasks done == multitask is done
+                            finished_multitasks.push_back(std::move(*queue_iterator));
+                            queue_iterator = queue_multitasks.erase(queue_iterator);
+                        }
+                        else
+                        {
+                            ++queue_iterator;
+                        }
                     }
                 }
+                for (task_multi & multitask : finished_multitasks)
+                {
+                    callback_finish_multitask(multitask);
+                }
                 // all tasks in the current loop is finished
                 callback_all_task_finished();
             }
@@ -319,8 +889,14 @@ struct llama_server_queue {
     }
 
     // updatethe remaining subtasks, while appending results to multitask
+    // only the final result of a subtask completes it, streamed partial results are dropped
     void update_multitask(int multitask_id, int subtask_id, task_result& result)
     {
+        if (!result.stop && !result.error)
+        {
+            return;
+        }
+
         std::lock_guard<std::mutex> lock(mutex_tasks);
         for (auto& multitask : queue_multitasks)
         {
@@ -353,16 +929,27 @@ struct llama_server_response {
         waiting_task_ids.erase(task_id);
     }
 
+    void add_waiting_task_ids(const std::unordered_set<int> & task_ids) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(task_ids.begin(), task_ids.end());
+    }
+
+    // also drops the results already received for them
+    void remove_waiting_task_ids(const std::unordered_set<int> & task_ids) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (int task_id : task_ids) {
+            waiting_task_ids.erase(task_id);
+        }
+        queue_results.erase(std::remove_if(queue_results.begin(), queue_results.end(), [&](const task_result & res) {
+            return task_ids.count(res.id) != 0;
+        }), queue_results.end());
+    }
+
     // This function blocks the thread until there is a response for this task_id
     task_result recv(int task_id) {
+        std::unique_lock<std::mutex> lock(mutex_results);
         while (true)
         {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
-            LOG_VERBOSE("condition_results unblock", {});
-
             for (int i = 0; i < (int) queue_results.size(); i++)
             {
                 if (queue_results[i].id == task_id)
@@ -373,9 +960,51 @@ struct llama_server_response {
                     return res;
                 }
             }
+
+            // the results of the other tasks stay queued for their threads
+            condition_results.wait(lock);
+            LOG_VERBOSE("condition_results unblock", {});
+        }
+    }
+
+    // Blocks the thread until there is a response for one of the task_ids
+    task_result recv(const std::unordered_set<int> & task_ids) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        while (true)
+        {
+            for (int i = 0; i < (int) queue_results.size(); i++)
+            {
+                if (task_ids.count(queue_results[i].id) != 0)
+                {
+                    task_result res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+            condition_results.wait(lock);
         }
+    }
 
-        // should never reach here
+    // Same, but gives up after timeout, so that the caller can check whether its client is gone
+    bool recv(const std::unordered_set<int> & task_ids, std::chrono::milliseconds timeout, task_result & result) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true)
+        {
+            for (int i = 0; i < (int) queue_results.size(); i++)
+            {
+                if (task_ids.count(queue_results[i].id) != 0)
+                {
+                    result = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return true;
+                }
+            }
+            if (condition_results.wait_until(lock, deadline) == std::cv_status::timeout)
+            {
+                return false;
+            }
+        }
     }
 
     // Register the function to update multitask
@@ -387,23 +1016,19 @@ struct llama_server_response {
     void send(task_result result) {
         std::unique_lock<std::mutex> lock(mutex_results);
         LOG_VERBOSE("send new result", {});
-        for (auto& task_id : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", task_id);
-            // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.multitask_id == task_id)
-            {
-                LOG_VERBOSE("callback_update_multitask", {});
-                callback_update_multitask(task_id, result.id, result);
-                continue;
-            }
+        // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
+        if (result.multitask_id != -1 && waiting_task_ids.count(result.multitask_id) != 0)
+        {
+            LOG_VERBOSE("callback_update_multitask", {});
+            callback_update_multitask(result.multitask_id, result.id, result);
+        }
 
-            if (result.id == task_id)
-            {
-                LOG_VERBOSE("queue_results.push_back", {});
-                queue_results.push_back(result);
-                condition_results.notify_one();
-                return;
-            }
+        if (waiting_task_ids.count(result.id) != 0)
+        {
+            LOG_VERBOSE("queue_results.push_back", {});
+            queue_results.push_back(result);
+            // several threads may wait, each for its own tasks
+            condition_results.notify_all();
         }
     }
 };
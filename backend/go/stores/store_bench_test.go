@@ -0,0 +1,66 @@
+package main
+
+// Counterpart of backend/cpp/llama/bench/bench-stores.cpp:
+//
+//	go test -run '^$' -bench StoresFind ./backend/go/stores/
+//
+// STORES_BENCH_KEYS and STORES_BENCH_DIM override the default 1M x 1024 keys.
+
+import (
+	"math"
+	"math/rand"
+	"os"
+	"strconv"
+	"testing"
+
+	pb "github.com/go-skynet/LocalAI/pkg/grpc/proto"
+)
+
+func benchEnv(name string, def int) int {
+	if v, err := strconv.Atoi(os.Getenv(name)); err == nil && v > 0 {
+		return v
+	}
+	return def
+}
+
+func randomKey(r *rand.Rand, dim int) *pb.StoresKey {
+	k := make([]float32, dim)
+	var norm float64
+	for i := range k {
+		k[i] = float32(r.NormFloat64())
+		norm += float64(k[i]) * float64(k[i])
+	}
+	norm = 1 / math.Sqrt(norm)
+	for i := range k {
+		k[i] = float32(float64(k[i]) * norm)
+	}
+	return &pb.StoresKey{Floats: k}
+}
+
+func BenchmarkStoresFind(b *testing.B) {
+	nKeys := benchEnv("STORES_BENCH_KEYS", 1000000)
+	dim := benchEnv("STORES_BENCH_DIM", 1024)
+	r := rand.New(rand.NewSource(1))
+
+	opts := &pb.StoresSetOptions{
+		Keys:   make([]*pb.StoresKey, nKeys),
+		Values: make([]*pb.StoresValue, nKeys),
+	}
+	for i := range opts.Keys {
+		opts.Keys[i] = randomKey(r, dim)
+		opts.Values[i] = &pb.StoresValue{Bytes: []byte(strconv.Itoa(i))}
+	}
+
+	s := NewStore()
+	if err := s.StoresSet(opts); err != nil {
+		b.Fatal(err)
+	}
+
+	query := &pb.StoresFindOptions{Key: randomKey(r, dim), TopK: 10}
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := s.StoresFind(query); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
@@ -2,7 +2,9 @@ package backend
 
 import (
 	"context"
+	"encoding/json"
 	"fmt"
+	"math"
 	"os"
 	"regexp"
 	"strings"
@@ -22,6 +24,7 @@ import (
 type LLMResponse struct {
 	Response string // should this be []byte?
 	Usage    TokenUsage
+	Logprobs []schema.TokenLogprob // when requested, only set without streaming
 }
 
 type TokenUsage struct {
@@ -162,6 +165,7 @@ func ModelInference(ctx context.Context, s string, messages []schema.Message, im
 			return LLMResponse{
 				Response: string(reply.Message),
 				Usage:    tokenUsage,
+				Logprobs: parseLogprobs(reply.Logprobs),
 			}, err
 		}
 	}
@@ -169,6 +173,57 @@ func ModelInference(ctx context.Context, s string, messages []schema.Message, im
 	return fn, nil
 }
 
+// parseLogprobs converts the top token probabilities reported by the backend,
+// [{"content": token, "prob": p, "probs": [{"tok_str": token, "prob": p}, ...]}, ...], to log probabilities
+func parseLogprobs(data []byte) []schema.TokenLogprob {
+	if len(data) == 0 {
+		return nil
+	}
+
+	var tokens []struct {
+		Content string   `json:"content"`
+		Prob    *float64 `json:"prob"` // of the generated token, also when it is not among the alternatives
+		Probs   []struct {
+			TokStr string  `json:"tok_str"`
+			Prob   float64 `json:"prob"`
+		} `json:"probs"`
+	}
+	if err := json.Unmarshal(data, &tokens); err != nil {
+		return nil
+	}
+
+	logprob := func(p float64) float64 {
+		// the value OpenAI uses for tokens too unlikely to be reported
+		if p <= 0 {
+			return -9999.0
+		}
+		return math.Log(p)
+	}
+	tokenBytes := func(s string) []int {
+		b := make([]int, len(s))
+		for i := 0; i < len(s); i++ {
+			b[i] = int(s[i])
+		}
+		return b
+	}
+
+	result := make([]schema.TokenLogprob, 0, len(tokens))
+	for _, t := range tokens {
+		lp := schema.TokenLogprob{Token: t.Content, Logprob: -9999.0, Bytes: tokenBytes(t.Content)}
+		if t.Prob != nil {
+			lp.Logprob = logprob(*t.Prob)
+		}
+		for _, alt := range t.Probs {
+			if t.Prob == nil && alt.TokStr == t.Content && lp.Logprob == -9999.0 {
+				lp.Logprob = logprob(alt.Prob)
+			}
+			lp.TopLogprobs = append(lp.TopLogprobs, schema.TokenLogprob{Token: alt.TokStr, Logprob: logprob(alt.Prob), Bytes: tokenBytes(alt.TokStr)})
+		}
+		result = append(result, lp)
+	}
+	return result
+}
+
 var cutstrings map[string]*regexp.Regexp = make(map[string]*regexp.Regexp)
 var mu sync.Mutex = sync.Mutex{}
 
@@ -46,8 +46,15 @@ func ComputeChoices(
 		tokenUsage.Completion += prediction.Usage.Completion
 
 		finetunedResponse := backend.Finetune(*config, predInput, prediction.Response)
+		first := len(result)
 		cb(finetunedResponse, &result)
 
+		if len(prediction.Logprobs) > 0 {
+			for j := first; j < len(result); j++ {
+				result[j].Logprobs = schema.NewLogprobs(prediction.Logprobs, config.ChatLogprobs())
+			}
+		}
+
 		//result = append(result, Choice{Text: prediction})
 
 	}
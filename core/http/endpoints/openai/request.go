@@ -216,6 +216,14 @@ func updateRequestConfig(config *config.BackendConfig, input *schema.OpenAIReque
 		config.Seed = input.Seed
 	}
 
+	if input.Logprobs != nil {
+		config.Logprobs = input.Logprobs
+	}
+
+	if input.TopLogprobs != nil {
+		config.TopLogprobs = input.TopLogprobs
+	}
+
 	if input.TypicalP != nil {
 		config.TypicalP = input.TypicalP
 	}
@@ -46,11 +46,52 @@ type OpenAIResponse struct {
 }
 
 type Choice struct {
-	Index        int      `json:"index"`
-	FinishReason string   `json:"finish_reason"`
-	Message      *Message `json:"message,omitempty"`
-	Delta        *Message `json:"delta,omitempty"`
-	Text         string   `json:"text,omitempty"`
+	Index        int       `json:"index"`
+	FinishReason string    `json:"finish_reason"`
+	Message      *Message  `json:"message,omitempty"`
+	Delta        *Message  `json:"delta,omitempty"`
+	Text         string    `json:"text,omitempty"`
+	Logprobs     *Logprobs `json:"logprobs,omitempty"`
+}
+
+// TokenLogprob is a generated token with its log probability and the most likely alternatives
+type TokenLogprob struct {
+	Token       string         `json:"token"`
+	Logprob     float64        `json:"logprob"`
+	Bytes       []int          `json:"bytes"`
+	TopLogprobs []TokenLogprob `json:"top_logprobs,omitempty"`
+}
+
+// Logprobs holds either the chat completions format (Content) or the completions one
+type Logprobs struct {
+	Content []TokenLogprob `json:"content,omitempty"`
+
+	Tokens        []string             `json:"tokens,omitempty"`
+	TokenLogprobs []float64            `json:"token_logprobs,omitempty"`
+	TopLogprobs   []map[string]float64 `json:"top_logprobs,omitempty"`
+	TextOffset    []int                `json:"text_offset,omitempty"`
+}
+
+// NewLogprobs formats the token log probabilities for chat completions or for completions
+func NewLogprobs(tokens []TokenLogprob, chat bool) *Logprobs {
+	if chat {
+		return &Logprobs{Content: tokens}
+	}
+
+	l := &Logprobs{}
+	offset := 0
+	for _, t := range tokens {
+		top := map[string]float64{}
+		for _, alt := range t.TopLogprobs {
+			top[alt.Token] = alt.Logprob
+		}
+		l.Tokens = append(l.Tokens, t.Token)
+		l.TokenLogprobs = append(l.TokenLogprobs, t.Logprob)
+		l.TopLogprobs = append(l.TopLogprobs, top)
+		l.TextOffset = append(l.TextOffset, offset)
+		offset += len(t.Token)
+	}
+	return l
 }
 
 type Content struct {
@@ -18,6 +18,11 @@ type PredictionOptions struct {
 	Maxtokens   *int     `json:"max_tokens" yaml:"max_tokens"`
 	Echo        bool     `json:"echo"`
 
+	// Also part of the OpenAI official spec: a boolean for chat completions, which use TopLogprobs
+	// for the number of alternatives, and that number for completions
+	Logprobs    interface{} `json:"logprobs" yaml:"logprobs"`
+	TopLogprobs *int        `json:"top_logprobs" yaml:"top_logprobs"`
+
 	// Custom parameters - not present in the OpenAI API
 	Batch         int     `json:"batch" yaml:"batch"`
 	IgnoreEOS     bool    `json:"ignore_eos" yaml:"ignore_eos"`
@@ -44,3 +49,35 @@ type PredictionOptions struct {
 	// RWKV (?)
 	Tokenizer string `json:"tokenizer" yaml:"tokenizer"`
 }
+
+// NProbs is the number of top token probabilities to request from the backend, 0 for none
+func (p PredictionOptions) NProbs() int {
+	n := 0
+	switch v := p.Logprobs.(type) {
+	case bool:
+		if !v {
+			return 0
+		}
+		if p.TopLogprobs != nil {
+			n = *p.TopLogprobs
+		}
+	case float64:
+		n = int(v)
+	case int:
+		n = v
+	default:
+		return 0
+	}
+	// the backend computes the probabilities, the one of the generated token included, only
+	// when at least one alternative is requested
+	if n < 1 {
+		n = 1
+	}
+	return n
+}
+
+// ChatLogprobs reports whether logprobs are requested in the chat completions format
+func (p PredictionOptions) ChatLogprobs() bool {
+	_, ok := p.Logprobs.(bool)
+	return ok
+}